@@ -8,7 +8,7 @@
 
 #include "FileHandlingException.h"
 
-class CopyFromCacheException : FileHandlingException {
+class CopyFromCacheException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
@@ -0,0 +1,10 @@
+#ifndef CADIR3_KEYCOMMANDEXCEPTION_H
+#define CADIR3_KEYCOMMANDEXCEPTION_H
+
+#include "CadirException.h"
+
+class KeyCommandException : public CadirException {
+    using CadirException::CadirException;
+};
+
+#endif //CADIR3_KEYCOMMANDEXCEPTION_H
@@ -8,7 +8,7 @@
 
 #include "FileHandlingException.h"
 
-class LinkFromCacheException : FileHandlingException {
+class LinkFromCacheException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
@@ -7,7 +7,7 @@
 
 #include "FileHandlingException.h"
 
-class SetupCommandException : FileHandlingException {
+class SetupCommandException : public FileHandlingException {
     using FileHandlingException::FileHandlingException;
 };
 
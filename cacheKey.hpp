@@ -0,0 +1,151 @@
+#pragma once //"cacheKey.hpp"
+
+#include <array>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include "exitCodeEnum.hpp"
+#include "Exceptions/KeyCommandException.h"
+
+/*
+ * Builds the name of a cache entry from a template like
+ * "{os}-{arch}-{env:PHP_VERSION}-{hash}", so agents of different platforms
+ * or runtimes can share one cache destination.
+ */
+namespace cacheKey {
+    const std::string defaultTemplate = "{hash}";
+
+    inline std::string lowerCase(std::string value) {
+        for (auto &character: value) {
+            character = static_cast<char>(tolower(static_cast<unsigned char>(character)));
+        }
+
+        return value;
+    }
+
+    /*
+     * Characters which are not safe in a file name become '_'. A leading dot
+     * is replaced too, those names are reserved for cadir's own files.
+     */
+    inline std::string sanitize(const std::string &key) {
+        std::string result(key);
+
+        for (auto &character: result) {
+            if (!isalnum(static_cast<unsigned char>(character)) &&
+                character != '-' && character != '_' && character != '.') {
+                character = '_';
+            }
+        }
+        if (!result.empty() && result.front() == '.') {
+            result.front() = '_';
+        }
+
+        return result;
+    }
+
+    inline std::string placeholderValue(const std::string &name, const std::string &hash) {
+        if (name == "hash") {
+            return hash;
+        }
+        if (name == "os" || name == "arch") {
+            struct utsname system{};
+            if (uname(&system) != 0) {
+                throw std::invalid_argument("Cannot determine " + name);
+            }
+
+            return lowerCase(name == "os" ? system.sysname : system.machine);
+        }
+        if (name.compare(0, 4, "env:") == 0) {
+            const char *value = getenv(name.substr(4).c_str());
+
+            return value != nullptr ? value : "";
+        }
+
+        throw std::invalid_argument("Unknown key template placeholder {" + name + "}");
+    }
+
+    // the template with its placeholders replaced, not yet sanitized
+    inline std::string expand(const std::string &keyTemplate, const std::string &hash, bool &hasHash) {
+        std::string key;
+        std::string::size_type position = 0;
+
+        while (position < keyTemplate.size()) {
+            std::string::size_type open = keyTemplate.find('{', position);
+            if (open == std::string::npos) {
+                key.append(keyTemplate, position, std::string::npos);
+                break;
+            }
+            std::string::size_type close = keyTemplate.find('}', open);
+            if (close == std::string::npos) {
+                throw std::invalid_argument("Unterminated placeholder in key template");
+            }
+
+            const std::string name = keyTemplate.substr(open + 1, close - open - 1);
+            hasHash = hasHash || name == "hash";
+            key.append(keyTemplate, position, open - position);
+            key.append(placeholderValue(name, hash));
+            position = close + 1;
+        }
+
+        return key;
+    }
+
+    /*
+     * A template without {hash} would give every identity the same entry,
+     * so it is rejected.
+     */
+    inline std::string render(const std::string &keyTemplate, const std::string &hash) {
+        bool hasHash = false;
+        std::string key = expand(keyTemplate, hash, hasHash);
+
+        if (!hasHash) {
+            throw std::invalid_argument("Key template must contain {hash}");
+        }
+
+        key = sanitize(key);
+        if (key.empty()) {
+            throw std::invalid_argument("Key template results in an empty key");
+        }
+
+        return key;
+    }
+
+    /*
+     * The rendered part of the template before {hash}, e.g. "linux-x86_64-8.2-"
+     * for "{os}-{arch}-{env:PHP_VERSION}-{hash}". Keys of other platforms or
+     * runtimes do not start with it.
+     */
+    inline std::string prefix(const std::string &keyTemplate) {
+        bool hasHash = false;
+
+        return sanitize(expand(keyTemplate.substr(0, keyTemplate.find("{hash}")), "", hasHash));
+    }
+
+    /*
+     * Standard output of the command, which is mixed into the hash.
+     */
+    inline std::string commandOutput(const std::string &command) {
+        std::array<char, 4096> buffer{};
+        std::string output;
+
+        FILE *pipe = popen(command.c_str(), "r");
+        if (!pipe) {
+            throw (KeyCommandException("Key command failed", ExitCode::keyCommandFailed));
+        }
+        size_t bytesRead;
+        while ((bytesRead = fread(buffer.data(), 1, buffer.size(), pipe)) > 0) {
+            output.append(buffer.data(), bytesRead);
+        }
+
+        int status = pclose(pipe);
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            throw (KeyCommandException("Key command failed", ExitCode::keyCommandFailed));
+        }
+
+        return output;
+    }
+}
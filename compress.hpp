@@ -7,6 +7,7 @@
 #include <vector>
 #include "exitCodeEnum.hpp"
 #include "Exceptions/GzipWriteReadException.h"
+#include "ioUring.hpp"
 #include <config.h>
 
 namespace compress {
@@ -86,6 +87,56 @@ namespace compress {
         }
     }
 
+    static std::string read_data(struct archive *ar, la_int64_t size) {
+        std::string data(static_cast<size_t>(size), '\0');
+        size_t offset = 0;
+
+        while (offset < data.size()) {
+            la_ssize_t r = archive_read_data(ar, &data[offset], data.size() - offset);
+            if (r < 0)
+                throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+            if (r == 0)
+                break;
+            offset += static_cast<size_t>(r);
+        }
+        data.resize(offset);
+
+        return data;
+    }
+
+    static void write_file(const uring::Item &item) {
+        stdfs::path parentPath = stdfs::path(item.target).parent_path();
+        if (!parentPath.empty())
+            stdfs::create_directories(parentPath);
+
+        int fd = open(item.target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0)
+            throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+
+        const struct timespec times[2] = {item.st.st_atim, item.st.st_mtim};
+        bool failed = write(fd, item.data.data(), item.data.size()) != static_cast<ssize_t>(item.data.size()) ||
+                      fchmod(fd, item.st.st_mode & 07777) != 0 ||
+                      futimens(fd, times) != 0;
+        if (close(fd) != 0 || failed)
+            throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+    }
+
+    static void write_batch(uring::Batch &batch) {
+        for (const auto &item: batch.flush())
+            write_file(item);
+    }
+
+    /* Only entries without ACLs, extended attributes or file flags are written without libarchive. */
+    static bool has_plain_attributes(struct archive_entry *entry) {
+        unsigned long set = 0;
+        unsigned long clear = 0;
+        archive_entry_fflags(entry, &set, &clear);
+
+        return archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_POSIX1E | ARCHIVE_ENTRY_ACL_TYPE_NFS4) == 0 &&
+               archive_entry_xattr_count(entry) == 0 &&
+               set == 0 && clear == 0;
+    }
+
     static int extract(const char *filename) {
         struct archive *a;
         struct archive *ext;
@@ -116,6 +167,9 @@ namespace compress {
             return 1;
         }
 
+        const bool batched = uring::available();
+        uring::Batch batch;
+
         for (;;) {
             r = archive_read_next_header(a, &entry);
             if (r == ARCHIVE_EOF)
@@ -124,6 +178,26 @@ namespace compress {
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
             if (r < ARCHIVE_WARN)
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
+
+            /* Small files are collected and written with few syscalls through io_uring. */
+            if (batched &&
+                archive_entry_filetype(entry) == AE_IFREG &&
+                archive_entry_hardlink(entry) == nullptr &&
+                archive_entry_size(entry) <= uring::smallFileSize &&
+                has_plain_attributes(entry)) {
+                uring::Item item{"", archive_entry_pathname(entry), *archive_entry_stat(entry), ""};
+                if (!archive_entry_atime_is_set(entry))
+                    item.st.st_atim = item.st.st_mtim;
+                item.data = read_data(a, archive_entry_size(entry));
+
+                batch.add(std::move(item));
+                if (batch.full())
+                    write_batch(batch);
+                continue;
+            }
+            /* Later entries may replace or link the collected files. */
+            write_batch(batch);
+
             r = archive_write_header(ext, entry);
             if (r < ARCHIVE_OK)
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
@@ -142,6 +216,8 @@ namespace compress {
                 throw (GzipWriteReadException("GZip Exception", ExitCode::gzipException));
         }
 
+        write_batch(batch);
+
         if (archive_read_close(a) ||
             archive_read_free(a) ||
             archive_write_close(ext) ||
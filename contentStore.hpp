@@ -0,0 +1,174 @@
+#pragma once //"contentStore.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "copyEngine.hpp"
+#include "keyLock.hpp"
+#include "manifest.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Content addressable storage of cache entries. Every file content is kept
+ * once as a blob named by its digest and mode, an entry is a tree of hard
+ * links to the blobs. A blob whose link count dropped to one belongs to no
+ * entry anymore and is removed by the garbage collection. Entries are built
+ * holding the lock file of the blob store shared, the collection holds it
+ * exclusively, so no blob is removed between being found and being linked.
+ */
+namespace contentStore {
+    const std::string blobDirectoryName = ".cadir-blobs";
+    const std::string lockExtension = ".lock";
+
+    inline std::string lockPath(const std::string &blobDirectory) {
+        stdfs::path directory(blobDirectory);
+        if (directory.filename().empty()) {
+            directory = directory.parent_path();
+        }
+
+        return directory.string() + lockExtension;
+    }
+
+    inline std::string blobPath(const std::string &blobDirectory, const std::string &digest, mode_t mode) {
+        char modeString[8];
+        snprintf(modeString, sizeof(modeString), "%04o", mode & 07777);
+
+        return blobDirectory + "/" + digest.substr(0, 2) + "/" + digest + "-" + modeString;
+    }
+
+    /*
+     * Copies the file into the blob store unless the blob exists already.
+     * The blob is written under a temporary name and renamed, so a blob is
+     * always complete and concurrent writers of the same blob do not clash.
+     */
+    inline void storeBlob(const std::string &file, const std::string &blob, const struct stat &fileStat) {
+        struct stat st{};
+        if (stat(blob.c_str(), &st) == 0) {
+            return;
+        }
+
+        stdfs::path blobFile(blob);
+        stdfs::create_directories(blobFile.parent_path());
+
+        std::string temporaryFile = blob + ".tmp." + std::to_string(getpid()) + "." +
+                                    std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        try {
+            copyEngine::copyFile(file, temporaryFile, fileStat);
+        } catch (...) {
+            unlink(temporaryFile.c_str());
+            throw;
+        }
+        if (rename(temporaryFile.c_str(), blob.c_str()) != 0) {
+            std::error_code errorCode;
+            stdfs::remove(temporaryFile, errorCode);
+            throw std::runtime_error("Cannot store blob " + blob);
+        }
+    }
+
+    /*
+     * Links the file of an entry to its blob. An inode can only have a
+     * limited number of links, beyond that the entry gets its own copy.
+     */
+    inline void linkBlob(const std::string &blob, const std::string &target) {
+        if (link(blob.c_str(), target.c_str()) == 0) {
+            return;
+        }
+        if (errno != EMLINK) {
+            throw std::runtime_error("Cannot link blob " + blob);
+        }
+
+        copyEngine::copyFile(blob, target);
+    }
+
+    /*
+     * Builds the entry directory from the manifest records of the source
+     * directory. Only blobs not yet present are written.
+     */
+    inline void store(
+            const std::string &sourceDirectory,
+            const std::string &entryDirectory,
+            const std::string &blobDirectory,
+            const std::vector<manifest::Record> &records,
+            size_t threadCount = 0
+    ) {
+        KeyLock storeLock(lockPath(blobDirectory));
+        storeLock.share();
+
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        const stdfs::path source(sourceDirectory);
+        const stdfs::path entry(entryDirectory);
+
+        struct stat sourceStat{};
+        if (stat(sourceDirectory.c_str(), &sourceStat) != 0) {
+            throw std::runtime_error("Cannot access " + sourceDirectory);
+        }
+
+        stdfs::create_directories(entry);
+        for (const auto &record: records) {
+            const stdfs::path target = entry / record.path;
+
+            if (record.isSymlink()) {
+                stdfs::create_symlink(record.linkTarget, target);
+            } else if (record.isDirectory()) {
+                stdfs::create_directory(target);
+            } else if (record.isFile()) {
+                std::string file = (source / record.path).string();
+                std::string targetFile = target.string();
+                const struct stat st = record.toStat(sourceStat.st_dev);
+                pool.submit([file, targetFile, blobDirectory, &record, st] {
+                    std::string blob = blobPath(blobDirectory, record.digest, st.st_mode);
+                    storeBlob(file, blob, st);
+                    linkBlob(blob, targetFile);
+                });
+            }
+        }
+
+        pool.wait();
+    }
+
+    /*
+     * Removes the blobs no entry links anymore, along with temporary files
+     * of crashed writers, unless an entry is being built right now. Returns
+     * the bytes freed.
+     */
+    inline uint64_t collectGarbage(const std::string &blobDirectory, size_t threadCount = 0) {
+        KeyLock storeLock(lockPath(blobDirectory));
+        if (!storeLock.tryExclusive()) {
+            return 0;
+        }
+
+        std::atomic<uint64_t> freed{0};
+        std::error_code errorCode;
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (stdfs::directory_iterator iterator(blobDirectory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            const std::string shard = iterator->path().string();
+            pool.submit([shard, &freed] {
+                std::error_code shardErrorCode;
+                for (stdfs::directory_iterator blob(shard, shardErrorCode), blobEnd;
+                     !shardErrorCode && blob != blobEnd;
+                     blob.increment(shardErrorCode)) {
+                    struct stat st{};
+                    if (lstat(blob->path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+                        unlink(blob->path().c_str()) == 0) {
+                        freed += static_cast<uint64_t>(st.st_size);
+                    }
+                }
+            });
+        }
+        pool.wait();
+
+        return freed;
+    }
+}
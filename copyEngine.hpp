@@ -0,0 +1,427 @@
+#pragma once //"copyEngine.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "ioUring.hpp"
+#include "manifest.hpp"
+#include "threadPool.hpp"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/*
+ * Copies files without moving the bytes through user space where the file
+ * systems allow it. A copy first tries to share the extents (FICLONE, on
+ * btrfs and XFS), then an in kernel copy (copy_file_range, sendfile) and
+ * last a buffered copy. Which method works is remembered per pair of
+ * source and target device, so later files go straight to it.
+ */
+namespace copyEngine {
+    const size_t bufferSize = 1024 * 1024;
+    const off_t largeFileSize = 1024 * 1024;
+    const size_t smallFileBatchSize = 64;
+    const size_t minimumJobs = 4;
+    const size_t maximumJobs = 32;
+
+    enum class Method {
+        clone,
+        copyFileRange,
+        sendfile,
+        buffered,
+    };
+
+    class FileDescriptor {
+        int descriptor;
+
+    public:
+        explicit FileDescriptor(int descriptor) : descriptor(descriptor) {}
+
+        FileDescriptor(const FileDescriptor &) = delete;
+
+        FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+        ~FileDescriptor() {
+            if (descriptor >= 0) {
+                close(descriptor);
+            }
+        }
+
+        int get() const {
+            return descriptor;
+        }
+    };
+
+    inline std::mutex &methodsMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    inline std::map<std::pair<dev_t, dev_t>, Method> &methods() {
+        static std::map<std::pair<dev_t, dev_t>, Method> knownMethods;
+        return knownMethods;
+    }
+
+    inline Method methodFor(dev_t sourceDevice, dev_t targetDevice) {
+        std::lock_guard<std::mutex> lock(methodsMutex());
+        auto method = methods().find({sourceDevice, targetDevice});
+
+        return method == methods().end() ? Method::clone : method->second;
+    }
+
+    inline void downgrade(dev_t sourceDevice, dev_t targetDevice, Method method) {
+        std::lock_guard<std::mutex> lock(methodsMutex());
+        Method &known = methods().emplace(std::make_pair(sourceDevice, targetDevice), Method::clone).first->second;
+
+        if (known < method) {
+            known = method;
+        }
+    }
+
+    // errors telling the method is not possible between these files, others are real failures
+    inline bool isUnsupported(int error) {
+        return error == EOPNOTSUPP || error == ENOTTY || error == ENOSYS ||
+               error == EXDEV || error == EINVAL || error == EBADF || error == ETXTBSY;
+    }
+
+    /*
+     * Copies length bytes with copy_file_range or sendfile. Returns false if
+     * the method is not supported and nothing was copied yet.
+     */
+    inline bool copyInKernel(int source, int target, off_t length, Method method) {
+        off_t copied = 0;
+
+        while (copied < length) {
+            size_t remaining = static_cast<size_t>(length - copied);
+            ssize_t result = method == Method::copyFileRange
+                             ? copy_file_range(source, nullptr, target, nullptr, remaining, 0)
+                             : sendfile(target, source, nullptr, remaining);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (copied == 0 && isUnsupported(errno)) {
+                    return false;
+                }
+                throw std::runtime_error("Cannot copy file");
+            }
+            if (result == 0) {
+                // the file shrank while copying or the file system reports no data
+                if (copied == 0) {
+                    return false;
+                }
+                break;
+            }
+            copied += result;
+        }
+
+        return true;
+    }
+
+    inline void copyBuffered(int source, int target) {
+        std::unique_ptr<char[]> buffer(new char[bufferSize]);
+
+        for (;;) {
+            ssize_t bytesRead = read(source, buffer.get(), bufferSize);
+            if (bytesRead == 0) {
+                return;
+            }
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Cannot read file");
+            }
+            for (ssize_t written = 0; written < bytesRead;) {
+                ssize_t result = write(target, buffer.get() + written, bytesRead - written);
+                if (result < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("Cannot write file");
+                }
+                written += result;
+            }
+        }
+    }
+
+    /*
+     * Copies a regular file with its permissions and modification time. An
+     * existing target is overwritten.
+     */
+    inline void copyFile(const std::string &sourceFile, const std::string &targetFile, const struct stat &st) {
+        FileDescriptor source(open(sourceFile.c_str(), O_RDONLY | O_CLOEXEC));
+        if (source.get() < 0) {
+            throw std::runtime_error("Cannot open " + sourceFile);
+        }
+        FileDescriptor target(open(targetFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (target.get() < 0) {
+            throw std::runtime_error("Cannot create " + targetFile);
+        }
+
+        struct stat targetStat{};
+        if (fstat(target.get(), &targetStat) != 0) {
+            throw std::runtime_error("Cannot access " + targetFile);
+        }
+        const dev_t sourceDevice = st.st_dev;
+        const dev_t targetDevice = targetStat.st_dev;
+
+        if (st.st_size > 0) {
+            Method method = methodFor(sourceDevice, targetDevice);
+            bool copied = false;
+
+            if (method == Method::clone) {
+                if (ioctl(target.get(), FICLONE, source.get()) == 0) {
+                    copied = true;
+                } else if (isUnsupported(errno)) {
+                    method = Method::copyFileRange;
+                    downgrade(sourceDevice, targetDevice, method);
+                } else {
+                    throw std::runtime_error("Cannot clone " + sourceFile);
+                }
+            }
+            while (!copied && (method == Method::copyFileRange || method == Method::sendfile)) {
+                if (copyInKernel(source.get(), target.get(), st.st_size, method)) {
+                    copied = true;
+                } else {
+                    method = method == Method::copyFileRange ? Method::sendfile : Method::buffered;
+                    downgrade(sourceDevice, targetDevice, method);
+                }
+            }
+            if (!copied) {
+                copyBuffered(source.get(), target.get());
+            }
+        }
+
+        const struct timespec times[2] = {st.st_atim, st.st_mtim};
+        if (fchmod(target.get(), st.st_mode & 07777) != 0 || futimens(target.get(), times) != 0) {
+            throw std::runtime_error("Cannot set attributes of " + targetFile);
+        }
+    }
+
+    inline void copyFile(const std::string &sourceFile, const std::string &targetFile) {
+        struct stat st{};
+        if (stat(sourceFile.c_str(), &st) != 0) {
+            throw std::runtime_error("Cannot access " + sourceFile);
+        }
+
+        copyFile(sourceFile, targetFile, st);
+    }
+
+    /*
+     * Copies a directory tree on a work stealing pool. Directories are read
+     * in parallel and created before their content, the files are copied
+     * afterwards, largest first, so no big file is left to a single thread
+     * at the end. Small files are copied in batches to keep the tasks few.
+     */
+    class TreeCopier {
+        struct File {
+            std::string relativePath;
+            struct stat st;
+        };
+
+        struct Directory {
+            std::string relativePath;
+            mode_t mode;
+        };
+
+        const std::string source;
+        const std::string target;
+        ThreadPool pool;
+        std::mutex mutex;
+        std::vector<File> files;
+        std::vector<Directory> directories;
+
+        // writable until the content is copied, the permissions are set at the end
+        void makeDirectory(const std::string &relativePath, mode_t mode) {
+            std::string targetPath = target + "/" + relativePath;
+            if (mkdir(targetPath.c_str(), S_IRWXU) != 0 &&
+                (errno != EEXIST || chmod(targetPath.c_str(), (mode & 07777) | S_IRWXU) != 0)) {
+                throw std::runtime_error("Cannot create directory " + targetPath);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            directories.push_back({relativePath, mode});
+        }
+
+        void makeSymlink(const std::string &relativePath, const std::string &linkTarget) {
+            std::string targetPath = target + "/" + relativePath;
+            unlink(targetPath.c_str());
+            if (symlink(linkTarget.c_str(), targetPath.c_str()) != 0) {
+                throw std::runtime_error("Cannot create symlink " + targetPath);
+            }
+        }
+
+        void walk(const std::string &relativeDirectory) {
+            const std::string directoryPath = relativeDirectory.empty() ? source : source + "/" + relativeDirectory;
+            auto closeDirectory = [](DIR *openDirectory) { closedir(openDirectory); };
+            std::unique_ptr<DIR, decltype(closeDirectory)> directory(opendir(directoryPath.c_str()), closeDirectory);
+            if (!directory) {
+                throw std::runtime_error("Cannot access directory " + directoryPath);
+            }
+
+            std::vector<File> directoryFiles;
+            while (struct dirent *entry = readdir(directory.get())) {
+                std::string name(entry->d_name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+
+                std::string relativePath = relativeDirectory.empty() ? name : relativeDirectory + "/" + name;
+                std::string path = source + "/" + relativePath;
+                struct stat st{};
+                if (lstat(path.c_str(), &st) != 0) {
+                    throw std::runtime_error("Cannot access " + path);
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                    makeDirectory(relativePath, st.st_mode);
+                    pool.submit([this, relativePath] { walk(relativePath); });
+                } else if (S_ISLNK(st.st_mode)) {
+                    makeSymlink(relativePath, stdfs::read_symlink(path).string());
+                } else if (S_ISREG(st.st_mode)) {
+                    directoryFiles.push_back({std::move(relativePath), st});
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            std::move(directoryFiles.begin(), directoryFiles.end(), std::back_inserter(files));
+        }
+
+        // the records are sorted, so every directory comes before its content
+        void plan(const std::vector<manifest::Record> &records) {
+            struct stat sourceStat{};
+            if (stat(source.c_str(), &sourceStat) != 0) {
+                throw std::runtime_error("Cannot access directory " + source);
+            }
+
+            for (const auto &record: records) {
+                if (record.isDirectory()) {
+                    makeDirectory(record.path, record.mode);
+                } else if (record.isSymlink()) {
+                    makeSymlink(record.path, record.linkTarget);
+                } else if (record.isFile()) {
+                    files.push_back({record.path, record.toStat(sourceStat.st_dev)});
+                }
+            }
+        }
+
+        void copy(const File &file) {
+            copyFile(source + "/" + file.relativePath, target + "/" + file.relativePath, file.st);
+        }
+
+        // small files go through io_uring, the ones it fails on are copied one by one
+        void copyBatched(size_t begin, size_t end) {
+            uring::Batch batch;
+            auto flush = [&batch] {
+                for (const auto &item: batch.flush()) {
+                    copyFile(item.source, item.target, item.st);
+                }
+            };
+
+            for (size_t i = begin; i < end; i++) {
+                if (files[i].st.st_size > uring::smallFileSize) {
+                    copy(files[i]);
+                    continue;
+                }
+                batch.add({source + "/" + files[i].relativePath, target + "/" + files[i].relativePath, files[i].st, ""});
+                if (batch.full()) {
+                    flush();
+                }
+            }
+            flush();
+        }
+
+    public:
+        TreeCopier(std::string source, std::string target, size_t threadCount) :
+                source(std::move(source)),
+                target(std::move(target)),
+                pool(threadCount) {}
+
+        void run(const std::vector<manifest::Record> *records) {
+            stdfs::create_directories(target);
+            if (records != nullptr) {
+                plan(*records);
+            } else {
+                pool.submit([this] { walk(""); });
+                pool.wait();
+            }
+
+            std::sort(files.begin(), files.end(), [](const File &left, const File &right) {
+                return left.st.st_size > right.st.st_size;
+            });
+            size_t index = 0;
+            for (; index < files.size() && files[index].st.st_size >= largeFileSize; index++) {
+                pool.submit([this, index] { copy(files[index]); });
+            }
+            for (; index < files.size(); index += smallFileBatchSize) {
+                pool.submit([this, index] {
+                    size_t end = std::min(index + smallFileBatchSize, files.size());
+                    if (uring::available()) {
+                        copyBatched(index, end);
+                        return;
+                    }
+                    for (size_t i = index; i < end; i++) {
+                        copy(files[i]);
+                    }
+                });
+            }
+            pool.wait();
+
+            for (const auto &directory: directories) {
+                std::string targetPath = target + "/" + directory.relativePath;
+                if (chmod(targetPath.c_str(), directory.mode & 07777) != 0) {
+                    throw std::runtime_error("Cannot change permissions of " + targetPath);
+                }
+            }
+        }
+    };
+
+    /*
+     * Syscall latency bounds copying many small files, not the cores, so
+     * more threads than cores pay off on local disks and even more so on
+     * network storage.
+     */
+    inline size_t defaultJobs() {
+        size_t hardwareThreads = std::thread::hardware_concurrency();
+
+        return std::min<size_t>(maximumJobs, std::max<size_t>(minimumJobs, 2 * hardwareThreads));
+    }
+
+    /*
+     * Copies the content of the source directory into the target directory,
+     * symlinks are copied as symlinks. With the records of its manifest the
+     * source is not walked. With no thread count the default is used.
+     */
+    inline void copyTree(
+            const std::string &sourceDirectory,
+            const std::string &targetDirectory,
+            size_t threadCount = 0,
+            const std::vector<manifest::Record> *records = nullptr
+    ) {
+        std::string source(sourceDirectory);
+        while (source.size() > 1 && source.back() == '/') {
+            source.pop_back();
+        }
+
+        TreeCopier(source, targetDirectory, threadCount == 0 ? defaultJobs() : threadCount).run(records);
+    }
+}
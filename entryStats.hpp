@@ -0,0 +1,103 @@
+#pragma once //"entryStats.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "storeLayout.hpp"
+
+/*
+ * What an entry cost, kept in ".cadir-stats" of the cache destination, in
+ * the layout of the entries, as a line "setupMilliseconds<TAB>size". The store index
+ * holds the same along with the hits, these files survive a lost index.
+ * Misses of keys are counted for the admission filter in a file growing by
+ * one byte per miss, appended to without a lock, so concurrent processes
+ * never lose a count. gc removes counters of keys without an entry which
+ * were not missed for a week.
+ */
+namespace entryStats {
+    const std::string statsDirectory = ".cadir-stats";
+    const std::string missesExtension = ".misses";
+    // counters of keys without an entry not missed for so long are removed by gc
+    const int64_t missesLifetime = 7 * 24 * 60 * 60;
+
+    struct Stats {
+        uint64_t setupMilliseconds = 0;
+        uint64_t size = 0;
+    };
+
+    inline std::string path(const std::string &destination, const std::string &name) {
+        return storeLayout::path(destination, (stdfs::path(destination) / statsDirectory).string(), name);
+    }
+
+    // written under a temporary name and renamed, readers never see half a file
+    inline void writeText(const std::string &file, const std::string &text) {
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(file).parent_path(), errorCode);
+
+        std::string temporaryFile = file + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream stream(temporaryFile, std::ios::trunc);
+            stream << text;
+            if (!stream.good()) {
+                stream.close();
+                stdfs::remove(temporaryFile, errorCode);
+                return;
+            }
+        }
+        stdfs::rename(temporaryFile, file, errorCode);
+        if (errorCode) {
+            stdfs::remove(temporaryFile, errorCode);
+        }
+    }
+
+    inline void write(const std::string &destination, const std::string &entryName, const Stats &stats) {
+        writeText(path(destination, entryName),
+                  std::to_string(stats.setupMilliseconds) + '\t' + std::to_string(stats.size) + '\n');
+    }
+
+    inline bool read(const std::string &destination, const std::string &entryName, Stats &stats) {
+        std::ifstream stream(path(destination, entryName));
+
+        return static_cast<bool>(stream >> stats.setupMilliseconds >> stats.size);
+    }
+
+    inline void increment(const std::string &file) {
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(file).parent_path(), errorCode);
+
+        int descriptor = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (descriptor >= 0) {
+            ssize_t written = ::write(descriptor, "\n", 1);
+            (void) written;
+            close(descriptor);
+        }
+    }
+
+    inline uint64_t count(const std::string &file) {
+        struct stat st{};
+
+        return stat(file.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    }
+
+    inline uint64_t misses(const std::string &destination, const std::string &entryName) {
+        return count(path(destination, entryName + missesExtension));
+    }
+
+    inline void recordMiss(const std::string &destination, const std::string &entryName) {
+        increment(path(destination, entryName + missesExtension));
+    }
+
+    /*
+     * The miss counter stays, so an entry evicted and missed again is
+     * admitted at once.
+     */
+    inline void remove(const std::string &destination, const std::string &entryName) {
+        std::error_code errorCode;
+        stdfs::remove(path(destination, entryName), errorCode);
+    }
+}
@@ -0,0 +1,324 @@
+#pragma once //"eviction.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <sys/stat.h>
+#include <config.h>
+#include "contentStore.hpp"
+#include "copyEngine.hpp"
+#include "entryStats.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "manifest.hpp"
+#include "store.hpp"
+#include "storeIndex.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Keeps the cache destination within a budget of size and entry count. By
+ * default entries are evicted GreedyDual-Size style: an entry's priority is
+ * the rebuild time it saves per byte, times its hits, plus the inflation
+ * value at its last access. The inflation rises to the priority of every
+ * evicted entry, so entries not used for long lose against new ones. Hits
+ * and inflation are kept in the store index. The least recently used policy
+ * ignores the costs. An entry is only evicted under its exclusive key lock,
+ * entries being restored hold it shared and are skipped, as are entries
+ * leased by a linked cache source. The size of an
+ * entry is the content size of its manifest, or of its files if it has
+ * none. Blobs shared through the content store are counted for every entry
+ * linking them, but only count as freed once the last entry linking them
+ * is evicted and the blob is removed.
+ */
+namespace eviction {
+    enum class Policy {
+        greedyDualSize,
+        leastRecentlyUsed,
+    };
+
+    inline Policy policyFromName(const std::string &name) {
+        if (name == "gds") {
+            return Policy::greedyDualSize;
+        }
+        if (name == "lru") {
+            return Policy::leastRecentlyUsed;
+        }
+
+        throw std::invalid_argument("Unknown eviction policy " + name);
+    }
+
+    struct Budget {
+        uint64_t maximumSize = 0;
+        size_t maximumEntries = 0;
+
+        bool isSet() const {
+            return maximumSize > 0 || maximumEntries > 0;
+        }
+
+        bool isExceeded(uint64_t size, size_t entries) const {
+            return (maximumSize > 0 && size > maximumSize) || (maximumEntries > 0 && entries > maximumEntries);
+        }
+    };
+
+    struct Candidate {
+        store::Entry entry;
+        uint64_t size = 0;
+        double priority = 0;
+    };
+
+    struct Result {
+        size_t evicted = 0;
+        uint64_t freed = 0;
+        size_t kept = 0;
+        uint64_t size = 0;
+    };
+
+    inline uint64_t treeSize(const std::string &directory) {
+        uint64_t size = 0;
+        std::error_code errorCode;
+
+        for (stdfs::recursive_directory_iterator iterator(directory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            struct stat st{};
+            if (lstat(iterator->path().c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                size += static_cast<uint64_t>(st.st_size);
+            }
+        }
+
+        return size;
+    }
+
+    /*
+     * Removes an entry tree, returns the size of the files whose last link
+     * went with it. Files still linked by a blob or a hard link restore
+     * keep their space.
+     */
+    inline uint64_t removeTree(const std::string &path) {
+        uint64_t freed = 0;
+        std::error_code errorCode;
+        struct stat st{};
+
+        if (lstat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+            freed = st.st_nlink == 1 ? static_cast<uint64_t>(st.st_size) : 0;
+        } else {
+            for (stdfs::recursive_directory_iterator iterator(path, errorCode), end;
+                 !errorCode && iterator != end;
+                 iterator.increment(errorCode)) {
+                if (lstat(iterator->path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+                    freed += static_cast<uint64_t>(st.st_size);
+                }
+            }
+        }
+        stdfs::remove_all(path, errorCode);
+
+        return freed;
+    }
+
+    inline double priority(const storeIndex::Record &record) {
+        double mebibytes = static_cast<double>(std::max<uint64_t>(record.size, 1)) / (1024 * 1024);
+
+        return record.base + (1 + static_cast<double>(record.hits)) *
+                             static_cast<double>(record.setupMilliseconds) / mebibytes;
+    }
+
+    inline uint64_t entrySize(const std::string &destination, const store::Entry &entry) {
+        entryStats::Stats stats;
+        if (entryStats::read(destination, store::entryName(entry), stats)) {
+            return stats.size;
+        }
+
+        struct stat st{};
+        if (entry.archive) {
+            return stat(entry.path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        }
+
+        std::unique_ptr<manifest::Manifest> entryManifest = manifest::Manifest::open(
+                store::manifestPath(destination, entry.key)
+        );
+
+        return entryManifest ? entryManifest->contentSize() : treeSize(entry.path);
+    }
+
+    /*
+     * All complete entries with their sizes and priorities, read in parallel.
+     */
+    inline std::vector<Candidate> scan(const std::string &destination, size_t threadCount) {
+        std::vector<Candidate> candidates;
+        for (bool archive: {false, true}) {
+            for (const auto &entry: store::list(destination, archive, threadCount)) {
+                candidates.push_back({entry, 0});
+            }
+        }
+
+        // entries the index does not know have the priority of a new entry of no cost
+        std::unique_ptr<storeIndex::Index> index = storeIndex::Index::load(destination);
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (auto &candidate: candidates) {
+            storeIndex::Record record;
+            if (index->find(store::entryName(candidate.entry), record)) {
+                candidate.size = record.size;
+                candidate.priority = priority(record);
+                continue;
+            }
+            candidate.priority = index->inflation();
+            pool.submit([&destination, &candidate] {
+                candidate.size = entrySize(destination, candidate.entry);
+            });
+        }
+        pool.wait();
+
+        return candidates;
+    }
+
+    /*
+     * Removes an entry unless another process holds its key lock or a cache
+     * source links to it under one of the leases. The completion marker goes
+     * first, so the entry is no hit while it is deleted. The bytes freed on
+     * disk are added to freed.
+     */
+    inline bool evict(
+            const std::string &destination,
+            const store::Entry &entry,
+            uint64_t &freed,
+            lease::Leases &leases
+    ) {
+        const std::string name = store::entryName(entry);
+        std::vector<std::unique_ptr<KeyLock>> keyLocks;
+        if (!store::lockExclusively(destination, name, keyLocks) || lease::isLeased(destination, name, leases)) {
+            return false;
+        }
+
+        std::error_code errorCode;
+        stdfs::remove(store::completionPath(destination, name), errorCode);
+        if (errorCode) {
+            return false;
+        }
+        // journaled only once the entry is no hit, the index never loses a complete entry
+        storeIndex::recordEviction(destination, name);
+
+        const std::string temporary = store::temporaryPath(destination, name);
+        stdfs::rename(entry.path, temporary, errorCode);
+        freed += removeTree(errorCode ? entry.path : temporary);
+
+        // the other kind of entry of the same key still needs them
+        const std::string otherName = entry.archive ? entry.key : entry.key + store::archiveExtension;
+        if (!store::isComplete(destination, otherName)) {
+            stdfs::remove(store::manifestPath(destination, entry.key), errorCode);
+            stdfs::remove(store::packageIndexPath(destination, entry.key), errorCode);
+        }
+        entryStats::remove(destination, name);
+
+        return true;
+    }
+
+    /*
+     * Removes the miss counters of keys without a complete entry which were
+     * not missed for the lifetime of a counter, and the lock files of keys
+     * without a complete entry no process holds. Returns the number of
+     * removed files.
+     */
+    inline size_t removeStale(const std::string &destination) {
+        size_t removed = 0;
+        const int64_t oldest = storeIndex::now() - entryStats::missesLifetime;
+        std::error_code errorCode;
+
+        for (stdfs::recursive_directory_iterator iterator(stdfs::path(destination) / entryStats::statsDirectory,
+                                                          errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().string();
+            const std::string entryName = name.substr(0, name.size() - entryStats::missesExtension.size());
+            struct stat st{};
+            if (!store::endsWith(name, entryStats::missesExtension) ||
+                lstat(iterator->path().c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+                static_cast<int64_t>(st.st_mtime) >= oldest || store::isComplete(destination, entryName)) {
+                continue;
+            }
+            std::error_code removeErrorCode;
+            if (stdfs::remove(iterator->path(), removeErrorCode)) {
+                removed++;
+            }
+        }
+
+        errorCode.clear();
+        for (stdfs::recursive_directory_iterator iterator(stdfs::path(destination) / store::lockDirectory,
+                                                          errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().string();
+            if (!store::endsWith(name, store::lockExtension) || !iterator->is_regular_file(errorCode) ||
+                store::isComplete(destination, name.substr(0, name.size() - store::lockExtension.size()))) {
+                errorCode.clear();
+                continue;
+            }
+            KeyLock keyLock(iterator->path().string());
+            if (keyLock.tryExclusive()) {
+                keyLock.remove();
+                removed++;
+            }
+        }
+
+        return removed;
+    }
+
+    /*
+     * Evicts entries of the lowest priority, or the least recently used
+     * ones, until the budget is met. The protected entry, usually the one
+     * just created, is never evicted.
+     */
+    inline Result enforce(
+            const std::string &destination,
+            const Budget &budget,
+            Policy policy,
+            const std::string &protectedName,
+            size_t threadCount
+    ) {
+        Result result;
+        std::vector<Candidate> candidates = scan(destination, threadCount);
+        std::sort(candidates.begin(), candidates.end(), [policy](const Candidate &left, const Candidate &right) {
+            if (policy == Policy::greedyDualSize && left.priority != right.priority) {
+                return left.priority < right.priority;
+            }
+            return left.entry.lastUsed < right.entry.lastUsed;
+        });
+        const double inflation = storeIndex::Index::load(destination)->inflation();
+        double raisedInflation = inflation;
+
+        for (const auto &candidate: candidates) {
+            result.size += candidate.size;
+        }
+        result.kept = candidates.size();
+
+        lease::Leases leases = lease::readAll(destination);
+        for (const auto &candidate: candidates) {
+            if (!budget.isExceeded(result.size, result.kept)) {
+                break;
+            }
+            if (store::entryName(candidate.entry) == protectedName ||
+                !evict(destination, candidate.entry, result.freed, leases)) {
+                continue;
+            }
+            result.evicted++;
+            result.kept--;
+            result.size -= candidate.size;
+            raisedInflation = std::max(raisedInflation, candidate.priority);
+        }
+        // blobs of the content store are only freed once no entry links them
+        if (result.evicted > 0) {
+            result.freed += contentStore::collectGarbage(
+                    (stdfs::path(destination) / contentStore::blobDirectoryName).string(),
+                    threadCount
+            );
+        }
+        if (raisedInflation > inflation) {
+            storeIndex::recordInflation(destination, raisedInflation);
+        }
+
+        return result;
+    }
+}
@@ -1,3 +1,5 @@
+#pragma once //"exitCodeEnum.hpp"
+
 enum ExitCode {
     ok = 0,
     argumentParsingFailed = 8,
@@ -10,4 +12,5 @@ enum ExitCode {
     cleaningFailed = 15,
     createCacheDirectoriesFailed = 16,
     gzipException = 17,
+    keyCommandFailed = 18,
 };
\ No newline at end of file
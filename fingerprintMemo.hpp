@@ -0,0 +1,367 @@
+#pragma once //"fingerprintMemo.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "hash.hpp"
+
+/*
+ * Remembers the digests of files by their stat data. As long as device,
+ * inode, size, modification and change time of a file are the same, the
+ * stored digest is returned without reading the file. The memo is a binary
+ * file of fixed size records sorted by path, mapped into memory on the
+ * first lookup and searched in place, so a call pays nothing for the
+ * records it does not look up. It is replaced atomically, writers merge
+ * under an exclusive lock. A memo of another format is taken as empty.
+ */
+class FingerprintMemo {
+public:
+    struct Fingerprint {
+        unsigned long long device = 0;
+        unsigned long long inode = 0;
+        long long size = 0;
+        long long modificationTime = 0;
+        long long changeTime = 0;
+
+        bool operator==(const Fingerprint &other) const {
+            return device == other.device &&
+                   inode == other.inode &&
+                   size == other.size &&
+                   modificationTime == other.modificationTime &&
+                   changeTime == other.changeTime;
+        }
+    };
+
+private:
+    struct Record {
+        Fingerprint fingerprint;
+        std::string digest;
+        long long recordedAt = 0;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t recordCount;
+        uint64_t stringsOffset;
+    };
+
+    struct RawRecord {
+        uint64_t keyOffset;
+        uint32_t keyLength;
+        uint32_t digestLength;
+        uint64_t digestOffset;
+        uint64_t device;
+        uint64_t inode;
+        int64_t size;
+        int64_t modificationTime;
+        int64_t changeTime;
+        int64_t recordedAt;
+    };
+
+    static constexpr char magic[8] = {'C', 'A', 'D', 'I', 'R', 'F', 'P', 'M'};
+    static constexpr uint32_t formatVersion = 1;
+    static constexpr uint32_t byteOrderMark = 0x01020304;
+    // files changed within this time may change again without a visible timestamp change
+    static constexpr long long racyIntervalNanoseconds = 2000000000LL;
+    static constexpr size_t maximumRecords = 500000;
+
+    const std::string memoFile;
+    std::mutex mutex;
+    bool mapped = false;
+    void *mapping = MAP_FAILED;
+    size_t length = 0;
+    size_t recordCount = 0;
+    std::map<std::string, Record> newRecords;
+
+    static long long nanoseconds(const struct timespec &time) {
+        return static_cast<long long>(time.tv_sec) * 1000000000LL + time.tv_nsec;
+    }
+
+    static long long now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static std::string recordKey(const std::string &variant, const std::string &path) {
+        return variant + "\t" + path;
+    }
+
+    const RawRecord *rawRecords() const {
+        return reinterpret_cast<const RawRecord *>(static_cast<const char *>(mapping) + sizeof(Header));
+    }
+
+    // a record pointing outside the file is damaged and never matches
+    bool isInside(uint64_t offset, uint64_t size) const {
+        return offset <= length && size <= length - offset;
+    }
+
+    void map() {
+        mapped = true;
+        int fd = open(memoFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Header))) {
+            length = static_cast<size_t>(st.st_size);
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            return;
+        }
+
+        const auto *header = static_cast<const Header *>(mapping);
+        if (memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+            header->version != formatVersion ||
+            header->byteOrder != byteOrderMark ||
+            header->recordCount > (length - sizeof(Header)) / sizeof(RawRecord) ||
+            header->stringsOffset != sizeof(Header) + header->recordCount * sizeof(RawRecord)) {
+            unmap();
+            return;
+        }
+        recordCount = static_cast<size_t>(header->recordCount);
+    }
+
+    void unmap() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, length);
+        }
+        mapping = MAP_FAILED;
+        length = 0;
+        recordCount = 0;
+    }
+
+    Record mappedRecord(const RawRecord &raw) const {
+        Record record;
+        record.fingerprint.device = raw.device;
+        record.fingerprint.inode = raw.inode;
+        record.fingerprint.size = raw.size;
+        record.fingerprint.modificationTime = raw.modificationTime;
+        record.fingerprint.changeTime = raw.changeTime;
+        record.recordedAt = raw.recordedAt;
+        if (isInside(raw.digestOffset, raw.digestLength)) {
+            record.digest.assign(static_cast<const char *>(mapping) + raw.digestOffset, raw.digestLength);
+        }
+
+        return record;
+    }
+
+    bool findMapped(const std::string &key, Record &record) const {
+        const RawRecord *raws = rawRecords();
+        size_t low = 0;
+        size_t high = recordCount;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            const RawRecord &raw = raws[middle];
+            if (!isInside(raw.keyOffset, raw.keyLength)) {
+                return false;
+            }
+            int comparison = key.compare(0, std::string::npos,
+                                         static_cast<const char *>(mapping) + raw.keyOffset, raw.keyLength);
+            if (comparison == 0) {
+                record = mappedRecord(raw);
+                return !record.digest.empty();
+            }
+            if (comparison < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+
+        return false;
+    }
+
+    // every record of the mapped memo, for merging
+    void readMapped(std::map<std::string, Record> &target) const {
+        const RawRecord *raws = rawRecords();
+        for (size_t i = 0; i < recordCount; i++) {
+            const RawRecord &raw = raws[i];
+            Record record = mappedRecord(raw);
+            if (isInside(raw.keyOffset, raw.keyLength) && !record.digest.empty()) {
+                target[std::string(static_cast<const char *>(mapping) + raw.keyOffset, raw.keyLength)] = record;
+            }
+        }
+    }
+
+    static bool write(const std::string &fileName, const std::vector<std::pair<std::string, Record>> &records) {
+        Header header{};
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.recordCount = records.size();
+        header.stringsOffset = sizeof(Header) + records.size() * sizeof(RawRecord);
+
+        std::vector<RawRecord> raws;
+        raws.reserve(records.size());
+        std::string strings;
+        for (const auto &entry: records) {
+            RawRecord raw{};
+            raw.keyOffset = header.stringsOffset + strings.size();
+            raw.keyLength = static_cast<uint32_t>(entry.first.size());
+            strings += entry.first;
+            raw.digestOffset = header.stringsOffset + strings.size();
+            raw.digestLength = static_cast<uint32_t>(entry.second.digest.size());
+            strings += entry.second.digest;
+            raw.device = entry.second.fingerprint.device;
+            raw.inode = entry.second.fingerprint.inode;
+            raw.size = entry.second.fingerprint.size;
+            raw.modificationTime = entry.second.fingerprint.modificationTime;
+            raw.changeTime = entry.second.fingerprint.changeTime;
+            raw.recordedAt = entry.second.recordedAt;
+            raws.push_back(raw);
+        }
+
+        std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(raws.data()),
+                   static_cast<std::streamsize>(raws.size() * sizeof(RawRecord)));
+        file.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        file.flush();
+
+        return file.good();
+    }
+
+public:
+    explicit FingerprintMemo(std::string memoFile) : memoFile(std::move(memoFile)) {}
+
+    ~FingerprintMemo() {
+        unmap();
+    }
+
+    FingerprintMemo(const FingerprintMemo &) = delete;
+
+    FingerprintMemo &operator=(const FingerprintMemo &) = delete;
+
+    static bool fingerprintOf(const std::string &path, Fingerprint &fingerprint) {
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+
+        fingerprint.device = st.st_dev;
+        fingerprint.inode = st.st_ino;
+        fingerprint.size = st.st_size;
+        fingerprint.modificationTime = nanoseconds(st.st_mtim);
+        fingerprint.changeTime = nanoseconds(st.st_ctim);
+
+        return true;
+    }
+
+    std::string digest(const std::string &fileName, hash::Algorithm algorithm) {
+        return digest(fileName, hash::algorithmName(algorithm), [algorithm](const std::string &path) {
+            return hash::fromFile(path, algorithm);
+        });
+    }
+
+    /*
+     * The variant names how the digest is computed, e.g. the algorithm. It
+     * must not contain white space.
+     */
+    std::string digest(
+            const std::string &fileName,
+            const std::string &variant,
+            const std::function<std::string(const std::string &)> &compute
+    ) {
+        std::string path = stdfs::absolute(fileName).lexically_normal().string();
+        std::string key = recordKey(variant, path);
+        Fingerprint before;
+
+        if (!fingerprintOf(path, before)) {
+            throw std::invalid_argument("Cannot access file");
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!mapped) {
+                map();
+            }
+            auto record = newRecords.find(key);
+            if (record != newRecords.end() && record->second.fingerprint == before) {
+                return record->second.digest;
+            }
+            Record stored;
+            if (findMapped(key, stored) && stored.fingerprint == before) {
+                return stored.digest;
+            }
+        }
+
+        long long hashStart = now();
+        std::string digest = compute(path);
+        Fingerprint after;
+
+        // only settled files are remembered, a file written during hashing is stale right away
+        if (fingerprintOf(path, after) && after == before &&
+            std::max(before.modificationTime, before.changeTime) < hashStart - racyIntervalNanoseconds) {
+            std::lock_guard<std::mutex> lock(mutex);
+            newRecords[key] = Record{before, digest, hashStart};
+        }
+
+        return digest;
+    }
+
+    /*
+     * Writes new records. The current memo is read again under the lock, so
+     * records other processes stored in the meantime are kept.
+     */
+    void save() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (newRecords.empty()) {
+            return;
+        }
+
+        std::string lockFile = memoFile + ".lock";
+        int lockDescriptor = open(lockFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (lockDescriptor < 0) {
+            return;
+        }
+        if (flock(lockDescriptor, LOCK_EX) != 0) {
+            close(lockDescriptor);
+            return;
+        }
+
+        unmap();
+        map();
+        std::map<std::string, Record> merged;
+        readMapped(merged);
+        for (const auto &record: newRecords) {
+            merged[record.first] = record.second;
+        }
+
+        std::vector<std::pair<std::string, Record>> ordered(merged.begin(), merged.end());
+        if (ordered.size() > maximumRecords) {
+            std::sort(ordered.begin(), ordered.end(), [](const auto &left, const auto &right) {
+                return left.second.recordedAt > right.second.recordedAt;
+            });
+            ordered.resize(maximumRecords);
+            std::sort(ordered.begin(), ordered.end(), [](const auto &left, const auto &right) {
+                return left.first < right.first;
+            });
+        }
+
+        std::string temporaryFile = memoFile + ".tmp." + std::to_string(getpid());
+        if (!write(temporaryFile, ordered) || rename(temporaryFile.c_str(), memoFile.c_str()) != 0) {
+            unlink(temporaryFile.c_str());
+        } else {
+            newRecords.clear();
+        }
+
+        close(lockDescriptor);
+    }
+};
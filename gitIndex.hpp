@@ -0,0 +1,348 @@
+#pragma once //"gitIndex.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "hash.hpp"
+#include "lockfile.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Reads the object ids git already computed for tracked files from the
+ * index (.git/index, versions 2 to 4) instead of reading the files.
+ */
+namespace git {
+    const size_t statBatchSize = 1024;
+
+    struct Repository {
+        std::string workTree;
+        std::string gitDirectory;
+        size_t objectIdLength = 20;
+    };
+
+    struct IndexEntry {
+        std::string path;
+        uint32_t mode = 0;
+        uint32_t modificationSeconds = 0;
+        uint32_t modificationNanoseconds = 0;
+        uint32_t inode = 0;
+        uint32_t size = 0;
+        std::string objectId;
+        unsigned stage = 0;
+        bool assumeUnchanged = false;
+    };
+
+    inline uint32_t readUint32(const unsigned char *data) {
+        return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+    }
+
+    inline uint16_t readUint16(const unsigned char *data) {
+        return uint16_t((data[0] << 8) | data[1]);
+    }
+
+    inline std::string trimmed(std::string value) {
+        value.erase(0, value.find_first_not_of(" \t\r\n"));
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+
+        return value;
+    }
+
+    /*
+     * Finds the work tree containing the path. A .git file, as used by
+     * worktrees and submodules, points to the real git directory.
+     */
+    inline Repository findRepository(const std::string &path) {
+        std::error_code pathErrorCode;
+        stdfs::path current = stdfs::absolute(path, pathErrorCode).lexically_normal();
+        if (pathErrorCode) {
+            throw std::invalid_argument("Cannot access " + path);
+        }
+        if (!stdfs::is_directory(current, pathErrorCode)) {
+            current = current.parent_path();
+        }
+
+        for (;;) {
+            stdfs::path dotGit = current / ".git";
+            std::error_code errorCode;
+
+            if (stdfs::is_directory(dotGit, errorCode)) {
+                Repository repository{current.string(), dotGit.string()};
+                std::string config = lockfile::readFile((dotGit / "config").string());
+                if (config.find("objectformat = sha256") != std::string::npos ||
+                    config.find("objectFormat = sha256") != std::string::npos) {
+                    repository.objectIdLength = 32;
+                }
+
+                return repository;
+            }
+            if (stdfs::is_regular_file(dotGit, errorCode)) {
+                std::string content = trimmed(lockfile::readFile(dotGit.string()));
+                if (content.compare(0, 8, "gitdir: ") != 0) {
+                    throw std::invalid_argument("Invalid .git file " + dotGit.string());
+                }
+                stdfs::path gitDirectory(content.substr(8));
+                if (gitDirectory.is_relative()) {
+                    gitDirectory = current / gitDirectory;
+                }
+
+                Repository repository{current.string(), gitDirectory.lexically_normal().string()};
+                std::string commonDirectory = gitDirectory.string();
+                std::error_code commonErrorCode;
+                if (stdfs::exists(gitDirectory / "commondir", commonErrorCode)) {
+                    stdfs::path common(trimmed(lockfile::readFile((gitDirectory / "commondir").string())));
+                    commonDirectory = (common.is_relative() ? gitDirectory / common : common).string();
+                }
+                std::ifstream configFile(commonDirectory + "/config");
+                std::string line;
+                while (std::getline(configFile, line)) {
+                    if (line.find("objectformat") != std::string::npos && line.find("sha256") != std::string::npos) {
+                        repository.objectIdLength = 32;
+                    }
+                }
+
+                return repository;
+            }
+            if (current == current.root_path()) {
+                throw std::invalid_argument("Not inside a git work tree: " + path);
+            }
+            current = current.parent_path();
+        }
+    }
+
+    inline std::vector<IndexEntry> readIndex(const Repository &repository) {
+        const std::string indexFile = repository.gitDirectory + "/index";
+        const std::string content = lockfile::readFile(indexFile);
+        const auto *data = reinterpret_cast<const unsigned char *>(content.data());
+        const size_t length = content.size();
+
+        if (length < 12 || memcmp(data, "DIRC", 4) != 0) {
+            throw std::invalid_argument("Invalid git index " + indexFile);
+        }
+        const uint32_t version = readUint32(data + 4);
+        const uint32_t count = readUint32(data + 8);
+        if (version < 2 || version > 4) {
+            throw std::invalid_argument("Unsupported git index version " + std::to_string(version));
+        }
+
+        // ctime, mtime, dev, ino, mode, uid, gid and size precede the object id
+        const size_t statLength = 40;
+        const size_t fixedLength = statLength + repository.objectIdLength + 2;
+        std::vector<IndexEntry> entries;
+        entries.reserve(count);
+        std::string previousPath;
+        size_t offset = 12;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (offset + fixedLength > length) {
+                throw std::invalid_argument("Truncated git index " + indexFile);
+            }
+            const unsigned char *entry = data + offset;
+            IndexEntry indexEntry;
+
+            indexEntry.modificationSeconds = readUint32(entry + 8);
+            indexEntry.modificationNanoseconds = readUint32(entry + 12);
+            indexEntry.inode = readUint32(entry + 20);
+            indexEntry.mode = readUint32(entry + 24);
+            indexEntry.size = readUint32(entry + 36);
+            indexEntry.objectId = hash::toHex(entry + statLength, repository.objectIdLength);
+
+            const uint16_t flags = readUint16(entry + statLength + repository.objectIdLength);
+            indexEntry.assumeUnchanged = (flags & 0x8000) != 0;
+            indexEntry.stage = (flags >> 12) & 0x3;
+            size_t headerLength = fixedLength;
+            if (flags & 0x4000) {
+                if (version < 3 || offset + headerLength + 2 > length) {
+                    throw std::invalid_argument("Invalid git index " + indexFile);
+                }
+                // skip-worktree entries have no file to compare with
+                if (readUint16(entry + headerLength) & 0x4000) {
+                    indexEntry.assumeUnchanged = true;
+                }
+                headerLength += 2;
+            }
+
+            const unsigned char *name = entry + headerLength;
+            const unsigned char *dataEnd = data + length;
+            if (version == 4) {
+                // the path is stored as the length to strip from the previous path and a new suffix
+                uint64_t strip = *name & 127;
+                while (*name & 128) {
+                    if (++name >= dataEnd) {
+                        throw std::invalid_argument("Truncated git index " + indexFile);
+                    }
+                    strip = ((strip + 1) << 7) | (*name & 127);
+                }
+                name++;
+                if (strip > previousPath.size()) {
+                    throw std::invalid_argument("Invalid git index " + indexFile);
+                }
+                const auto *end = static_cast<const unsigned char *>(memchr(name, 0, dataEnd - name));
+                if (end == nullptr) {
+                    throw std::invalid_argument("Truncated git index " + indexFile);
+                }
+                indexEntry.path = previousPath.substr(0, previousPath.size() - strip) +
+                                  std::string(reinterpret_cast<const char *>(name), end - name);
+                offset = (end + 1) - data;
+            } else {
+                const auto *end = static_cast<const unsigned char *>(memchr(name, 0, dataEnd - name));
+                if (end == nullptr) {
+                    throw std::invalid_argument("Truncated git index " + indexFile);
+                }
+                indexEntry.path.assign(reinterpret_cast<const char *>(name), end - name);
+                // entries are padded with NUL bytes to a multiple of eight
+                offset += (headerLength + indexEntry.path.size() + 8) & ~size_t(7);
+            }
+
+            previousPath = indexEntry.path;
+            entries.push_back(std::move(indexEntry));
+        }
+
+        return entries;
+    }
+
+    /*
+     * The object id git would give the file in the work tree, for files
+     * which differ from their index entry.
+     */
+    inline std::string blobId(const std::string &path, uint32_t mode, size_t objectIdLength) {
+        hash::EvpHasher hasher(objectIdLength == 32 ? EVP_sha256() : EVP_sha1());
+
+        if ((mode & 0170000) == 0120000) {
+            std::error_code errorCode;
+            std::string target = stdfs::read_symlink(path, errorCode).string();
+            if (errorCode) {
+                throw std::invalid_argument("Cannot read link " + path);
+            }
+            std::string header = "blob " + std::to_string(target.size());
+            hasher.update(header.c_str(), header.size() + 1);
+            hasher.update(target.data(), target.size());
+
+            return hasher.finish();
+        }
+
+        struct stat st{};
+        if (stat(path.c_str(), &st) != 0) {
+            throw std::invalid_argument("Cannot access file " + path);
+        }
+        std::string header = "blob " + std::to_string(st.st_size);
+        hasher.update(header.c_str(), header.size() + 1);
+        hash::readChunks(path, [&hasher](const unsigned char *data, size_t length) {
+            hasher.update(data, length);
+        });
+
+        return hasher.finish();
+    }
+
+    struct TrackedFile {
+        std::string relativePath;
+        char type;
+        std::string objectId;
+    };
+
+    /*
+     * Tracked files below the path with their object ids. Files whose stat
+     * data differs from the index, or which changed in the same second the
+     * index was written, are hashed like git would. Deleted files are left
+     * out, untracked files are not seen.
+     */
+    inline std::vector<TrackedFile> trackedFiles(const std::string &path, size_t threadCount) {
+        Repository repository = findRepository(path);
+        std::vector<IndexEntry> entries = readIndex(repository);
+
+        std::string prefix = stdfs::absolute(path).lexically_normal().lexically_relative(repository.workTree).string();
+        if (prefix == ".") {
+            prefix.clear();
+        }
+        while (!prefix.empty() && prefix.back() == '/') {
+            prefix.pop_back();
+        }
+
+        struct stat indexStat{};
+        stat((repository.gitDirectory + "/index").c_str(), &indexStat);
+
+        std::vector<const IndexEntry *> selected;
+        for (const auto &entry: entries) {
+            // of a conflict only our side is kept, it is hashed from the work tree
+            if (entry.stage == 1 || entry.stage == 3) {
+                continue;
+            }
+            if (prefix.empty() ||
+                entry.path == prefix ||
+                (entry.path.size() > prefix.size() &&
+                 entry.path.compare(0, prefix.size(), prefix) == 0 &&
+                 entry.path[prefix.size()] == '/')) {
+                selected.push_back(&entry);
+            }
+        }
+
+        std::vector<TrackedFile> files(selected.size());
+        std::vector<char> present(selected.size(), 0);
+        {
+            ThreadPool pool(threadCount);
+
+            for (size_t start = 0; start < selected.size(); start += statBatchSize) {
+                pool.submit([&, start] {
+                    size_t end = std::min(start + statBatchSize, selected.size());
+                    for (size_t i = start; i < end; i++) {
+                        const IndexEntry &entry = *selected[i];
+                        std::string filePath = repository.workTree + "/" + entry.path;
+                        std::string relativePath = prefix.empty() || entry.path == prefix
+                                                   ? entry.path
+                                                   : entry.path.substr(prefix.size() + 1);
+                        uint32_t type = entry.mode & 0170000;
+                        char leafType = type == 0120000 ? 'l'
+                                        : type == 0160000 ? 'g'
+                                        : (entry.mode & 0111) ? 'x' : 'f';
+
+                        // submodules and skip-worktree entries are taken as recorded
+                        if (type == 0160000 || (entry.assumeUnchanged && entry.stage == 0)) {
+                            files[i] = {relativePath, leafType, entry.objectId};
+                            present[i] = 1;
+                            continue;
+                        }
+
+                        struct stat st{};
+                        if (lstat(filePath.c_str(), &st) != 0) {
+                            continue;
+                        }
+
+                        bool racy = static_cast<long long>(entry.modificationSeconds) >= indexStat.st_mtim.tv_sec;
+                        bool clean = entry.stage == 0 && !racy &&
+                                     uint32_t(st.st_size) == entry.size &&
+                                     uint32_t(st.st_mtim.tv_sec) == entry.modificationSeconds &&
+                                     uint32_t(st.st_mtim.tv_nsec) == entry.modificationNanoseconds &&
+                                     uint32_t(st.st_ino) == entry.inode;
+                        uint32_t mode = S_ISLNK(st.st_mode) ? 0120000 : uint32_t(st.st_mode);
+                        char currentType = S_ISLNK(st.st_mode) ? 'l' : (st.st_mode & S_IXUSR) ? 'x' : 'f';
+
+                        files[i] = {
+                                relativePath,
+                                clean ? leafType : currentType,
+                                clean ? entry.objectId : blobId(filePath, mode, repository.objectIdLength)
+                        };
+                        present[i] = 1;
+                    }
+                });
+            }
+            pool.wait();
+        }
+
+        std::vector<TrackedFile> result;
+        result.reserve(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            if (present[i]) {
+                result.push_back(std::move(files[i]));
+            }
+        }
+
+        return result;
+    }
+}
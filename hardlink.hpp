@@ -0,0 +1,107 @@
+#pragma once //"hardlink.hpp"
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "copyEngine.hpp"
+#include "identity.hpp"
+#include "manifest.hpp"
+
+/*
+ * Restores a cache entry as a tree of hard links, following its manifest.
+ * Directories are created, files share their inode with the cache entry.
+ * The shared files are made read-only, so a build can not change the cache
+ * through them. Their modes as cached stay in the manifest, which copy
+ * restores follow, so they get the original modes. Files which are written
+ * in place get a private copy instead.
+ */
+namespace hardlink {
+    const mode_t writePermissions = S_IWUSR | S_IWGRP | S_IWOTH;
+
+    inline bool isPrivate(const std::string &relativePath, const std::vector<std::string> &privatePatterns) {
+        for (const auto &pattern: privatePatterns) {
+            if (identity::TreeFilter::matches(pattern, relativePath)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /*
+     * A private copy gets the mode of the manifest, even if the cached file
+     * was protected by an earlier restore.
+     */
+    inline void privateCopy(const std::string &file, const std::string &target, const struct stat &st) {
+        copyEngine::copyFile(file, target, st);
+    }
+
+    inline void linkFile(const std::string &file, const std::string &target, const struct stat &st) {
+        if ((st.st_mode & writePermissions) && chmod(file.c_str(), st.st_mode & 07777 & ~writePermissions) != 0) {
+            throw std::runtime_error("Cannot protect " + file);
+        }
+        if (link(file.c_str(), target.c_str()) == 0) {
+            return;
+        }
+        // another file system or too many links to the inode
+        if (errno != EXDEV && errno != EMLINK) {
+            throw std::runtime_error("Cannot link " + file);
+        }
+
+        privateCopy(file, target, st);
+    }
+
+    /*
+     * Directories are created writable and get their modes after their
+     * content, as the copy engine does, so read-only directories can be
+     * filled by users other than root.
+     */
+    inline void materialize(
+            const std::string &entryDirectory,
+            const std::string &targetDirectory,
+            const std::vector<std::string> &privatePatterns,
+            const std::vector<manifest::Record> &records
+    ) {
+        const stdfs::path entry(entryDirectory);
+        const stdfs::path target(targetDirectory);
+        std::vector<const manifest::Record *> directories;
+
+        struct stat entryStat{};
+        if (stat(entryDirectory.c_str(), &entryStat) != 0) {
+            throw std::runtime_error("Cannot access " + entryDirectory);
+        }
+
+        stdfs::create_directories(target);
+        for (const auto &record: records) {
+            const std::string file = (entry / record.path).string();
+            const std::string targetFile = (target / record.path).string();
+
+            if (record.isSymlink()) {
+                stdfs::create_symlink(record.linkTarget, targetFile);
+            } else if (record.isDirectory()) {
+                if (mkdir(targetFile.c_str(), S_IRWXU) != 0) {
+                    throw std::runtime_error("Cannot create directory " + targetFile);
+                }
+                directories.push_back(&record);
+            } else if (record.isFile()) {
+                const struct stat st = record.toStat(entryStat.st_dev);
+                if (isPrivate(record.path, privatePatterns)) {
+                    privateCopy(file, targetFile, st);
+                } else {
+                    linkFile(file, targetFile, st);
+                }
+            }
+        }
+
+        for (auto directory = directories.rbegin(); directory != directories.rend(); directory++) {
+            const std::string targetFile = (target / (*directory)->path).string();
+            if (chmod(targetFile.c_str(), (*directory)->mode & 07777) != 0) {
+                throw std::runtime_error("Cannot change permissions of " + targetFile);
+            }
+        }
+    }
+}
@@ -0,0 +1,229 @@
+#pragma once //"hash.hpp"
+
+#include <string>
+#include <stdexcept>
+#include <memory>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "openssl/evp.h"
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+#include "blake3.h"
+
+namespace hash {
+    // large, page aligned chunks keep the read syscalls few while memory stays constant
+    const size_t chunkSize = 1024 * 1024;
+    const size_t chunkAlignment = 4096;
+
+    enum class Algorithm {
+        md5,
+        sha256,
+        xxh3,
+        blake3,
+    };
+
+    const std::string defaultAlgorithmName = "md5";
+
+    inline std::string toHex(const unsigned char *data, size_t length) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(length * 2);
+
+        for (size_t i = 0; i < length; i++) {
+            hex.push_back(digits[data[i] >> 4]);
+            hex.push_back(digits[data[i] & 0x0f]);
+        }
+
+        return hex;
+    }
+
+    inline Algorithm algorithmFromName(const std::string &name) {
+        if (name == "md5") return Algorithm::md5;
+        if (name == "sha256") return Algorithm::sha256;
+        if (name == "xxh3") return Algorithm::xxh3;
+        if (name == "blake3") return Algorithm::blake3;
+
+        throw std::invalid_argument("Unknown hash algorithm: " + name);
+    }
+
+    inline std::string algorithmName(Algorithm algorithm) {
+        switch (algorithm) {
+            case Algorithm::sha256:
+                return "sha256";
+            case Algorithm::xxh3:
+                return "xxh3";
+            case Algorithm::blake3:
+                return "blake3";
+            default:
+                return "md5";
+        }
+    }
+
+    /*
+     * Prefix of cache entry names so keys of different algorithms can share
+     * one cache destination. md5 has none to keep existing caches valid.
+     */
+    inline std::string keyPrefix(Algorithm algorithm) {
+        switch (algorithm) {
+            case Algorithm::sha256:
+                return "sha256-";
+            case Algorithm::xxh3:
+                return "xxh3-";
+            case Algorithm::blake3:
+                return "blake3-";
+            default:
+                return "";
+        }
+    }
+
+    class Hasher {
+    public:
+        virtual ~Hasher() = default;
+
+        virtual void update(const void *data, size_t length) = 0;
+
+        virtual std::string finish() = 0;
+    };
+
+    class EvpHasher : public Hasher {
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context;
+
+    public:
+        explicit EvpHasher(const EVP_MD *digest) : context(EVP_MD_CTX_new(), &EVP_MD_CTX_free) {
+            if (!context || EVP_DigestInit_ex(context.get(), digest, nullptr) != 1) {
+                throw std::runtime_error("Cannot initialize digest");
+            }
+        }
+
+        void update(const void *data, size_t length) override {
+            EVP_DigestUpdate(context.get(), data, length);
+        }
+
+        std::string finish() override {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+
+            EVP_DigestFinal_ex(context.get(), digest, &length);
+
+            return toHex(digest, length);
+        }
+    };
+
+    class Xxh3Hasher : public Hasher {
+        std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)> state;
+
+    public:
+        Xxh3Hasher() : state(XXH3_createState(), &XXH3_freeState) {
+            if (!state || XXH3_128bits_reset(state.get()) != XXH_OK) {
+                throw std::runtime_error("Cannot initialize digest");
+            }
+        }
+
+        void update(const void *data, size_t length) override {
+            XXH3_128bits_update(state.get(), data, length);
+        }
+
+        std::string finish() override {
+            XXH128_canonical_t canonical;
+
+            XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state.get()));
+
+            return toHex(canonical.digest, sizeof(canonical.digest));
+        }
+    };
+
+    class Blake3Hasher : public Hasher {
+        blake3_hasher hasher{};
+
+    public:
+        Blake3Hasher() {
+            blake3_hasher_init(&hasher);
+        }
+
+        void update(const void *data, size_t length) override {
+            blake3_hasher_update(&hasher, data, length);
+        }
+
+        std::string finish() override {
+            uint8_t digest[BLAKE3_OUT_LEN];
+
+            blake3_hasher_finalize(&hasher, digest, BLAKE3_OUT_LEN);
+
+            return toHex(digest, BLAKE3_OUT_LEN);
+        }
+    };
+
+    inline std::unique_ptr<Hasher> createHasher(Algorithm algorithm) {
+        switch (algorithm) {
+            case Algorithm::sha256:
+                return std::unique_ptr<Hasher>(new EvpHasher(EVP_sha256()));
+            case Algorithm::xxh3:
+                return std::unique_ptr<Hasher>(new Xxh3Hasher());
+            case Algorithm::blake3:
+                return std::unique_ptr<Hasher>(new Blake3Hasher());
+            default:
+                return std::unique_ptr<Hasher>(new EvpHasher(EVP_md5()));
+        }
+    }
+
+    /*
+     * Reads the file in fixed size chunks and hands every chunk to the
+     * consumer. The whole byte length is passed on, embedded NUL bytes included.
+     */
+    template<typename Consumer>
+    void readChunks(const std::string &fileName, Consumer consumer) {
+        int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::invalid_argument("Cannot access file");
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        std::unique_ptr<unsigned char, decltype(&free)> buffer(
+                static_cast<unsigned char *>(aligned_alloc(chunkAlignment, chunkSize)),
+                &free
+        );
+        if (!buffer) {
+            close(fd);
+            throw std::bad_alloc();
+        }
+
+        for (;;) {
+            ssize_t bytesRead = read(fd, buffer.get(), chunkSize);
+            if (bytesRead == 0) {
+                break;
+            }
+            if (bytesRead < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                close(fd);
+                throw std::invalid_argument("Cannot read file");
+            }
+            consumer(buffer.get(), static_cast<size_t>(bytesRead));
+        }
+
+        close(fd);
+    }
+
+    inline std::string fromFile(const std::string &fileName, Algorithm algorithm) {
+        auto hasher = createHasher(algorithm);
+
+        readChunks(fileName, [&hasher](const unsigned char *data, size_t length) {
+            hasher->update(data, length);
+        });
+
+        return hasher->finish();
+    }
+
+    inline std::string fromString(const std::string &content, Algorithm algorithm) {
+        auto hasher = createHasher(algorithm);
+
+        hasher->update(content.data(), content.size());
+
+        return hasher->finish();
+    }
+}
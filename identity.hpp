@@ -0,0 +1,435 @@
+#pragma once //"identity.hpp"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "hash.hpp"
+#include "fingerprintMemo.hpp"
+#include "lockfile.hpp"
+#include "gitIndex.hpp"
+#include "threadPool.hpp"
+
+namespace identity {
+    const size_t maximumHashThreads = 8;
+    const size_t maximumTreeThreads = 16;
+
+    enum class Mode {
+        // the raw bytes of a file
+        content,
+        // the resolved packages of known lock files, other files by content
+        semantic,
+    };
+
+    inline Mode modeFromName(const std::string &name) {
+        if (name == "content") return Mode::content;
+        if (name == "semantic") return Mode::semantic;
+
+        throw std::invalid_argument("Unknown identity mode: " + name);
+    }
+
+    inline std::string fileDigest(const std::string &path, hash::Algorithm algorithm, FingerprintMemo *memo) {
+        return memo != nullptr ? memo->digest(path, algorithm) : hash::fromFile(path, algorithm);
+    }
+
+    inline std::string fileDigest(
+            const std::string &path,
+            hash::Algorithm algorithm,
+            Mode mode,
+            FingerprintMemo *memo
+    ) {
+        if (mode == Mode::content || lockfile::formatOf(path) == lockfile::Format::unknown) {
+            return fileDigest(path, algorithm, memo);
+        }
+
+        auto compute = [algorithm](const std::string &file) {
+            return lockfile::semanticDigest(file, algorithm);
+        };
+
+        return memo != nullptr
+               ? memo->digest(path, "semantic-" + hash::algorithmName(algorithm), compute)
+               : compute(path);
+    }
+
+    inline bool isPattern(const std::string &path) {
+        return path.find_first_of("*?[") != std::string::npos;
+    }
+
+    /*
+     * Resolves glob patterns to the files they match. Plain paths are kept as
+     * they are, a missing file is reported when it is hashed. The result is
+     * sorted and free of duplicates, so the combined key is stable.
+     */
+    inline std::vector<std::string> expandPatterns(const std::vector<std::string> &patterns) {
+        std::vector<std::string> files;
+
+        for (const auto &pattern: patterns) {
+            if (!isPattern(pattern)) {
+                files.push_back(pattern);
+                continue;
+            }
+
+            glob_t globResult{};
+            int result = glob(pattern.c_str(), GLOB_MARK, nullptr, &globResult);
+            if (result != 0) {
+                globfree(&globResult);
+                throw std::invalid_argument("No identity file matches " + pattern);
+            }
+            for (size_t i = 0; i < globResult.gl_pathc; i++) {
+                std::string match(globResult.gl_pathv[i]);
+                // GLOB_MARK appends a slash to directories, which are no identity files
+                if (match.back() != '/') {
+                    files.push_back(match);
+                }
+            }
+            globfree(&globResult);
+        }
+
+        std::sort(files.begin(), files.end());
+        files.erase(std::unique(files.begin(), files.end()), files.end());
+
+        if (files.empty()) {
+            throw std::invalid_argument("No identity file given");
+        }
+
+        return files;
+    }
+
+    /*
+     * The path of an identity file as it counts for the key: relative to the
+     * working directory, so checkouts in different directories, e.g. per
+     * branch or per agent, share their caches.
+     */
+    inline std::string keyPath(const std::string &file) {
+        std::error_code errorCode;
+        const stdfs::path path(file);
+        const stdfs::path workingDirectory = stdfs::current_path(errorCode);
+
+        if (errorCode || !path.is_absolute()) {
+            return path.lexically_normal().string();
+        }
+
+        return path.lexically_proximate(workingDirectory).string();
+    }
+
+    /*
+     * A single file keeps the plain digest of its content. Several files are
+     * hashed concurrently and their digests are combined in the order of
+     * their paths relative to the working directory.
+     */
+    inline std::string fromFiles(
+            const std::vector<std::string> &files,
+            hash::Algorithm algorithm,
+            Mode mode = Mode::content,
+            FingerprintMemo *memo = nullptr
+    ) {
+        if (files.size() == 1) {
+            return fileDigest(files.front(), algorithm, mode, memo);
+        }
+
+        std::vector<std::string> digests(files.size());
+        {
+            ThreadPool pool(ThreadPool::defaultThreadCount(std::min(files.size(), maximumHashThreads)));
+
+            for (size_t i = 0; i < files.size(); i++) {
+                pool.submit([&files, &digests, i, algorithm, mode, memo] {
+                    digests[i] = fileDigest(files[i], algorithm, mode, memo);
+                });
+            }
+            pool.wait();
+        }
+
+        std::vector<std::pair<std::string, std::string>> namedDigests;
+        for (size_t i = 0; i < files.size(); i++) {
+            namedDigests.emplace_back(keyPath(files[i]), digests[i]);
+        }
+        std::sort(namedDigests.begin(), namedDigests.end());
+
+        auto hasher = hash::createHasher(algorithm);
+        for (const auto &namedDigest: namedDigests) {
+            hasher->update(namedDigest.first.data(), namedDigest.first.size());
+            hasher->update("\0", 1);
+            hasher->update(namedDigest.second.data(), namedDigest.second.size());
+            hasher->update("\n", 1);
+        }
+
+        return hasher->finish();
+    }
+
+    /*
+     * Combines the digests of several identity sources, in the given order.
+     */
+    inline std::string combine(const std::vector<std::string> &digests, hash::Algorithm algorithm) {
+        if (digests.size() == 1) {
+            return digests.front();
+        }
+
+        auto hasher = hash::createHasher(algorithm);
+        for (const auto &digest: digests) {
+            hasher->update(digest.data(), digest.size());
+            hasher->update("\n", 1);
+        }
+
+        return hasher->finish();
+    }
+
+    struct TreeFilter {
+        std::vector<std::string> includes;
+        std::vector<std::string> excludes;
+
+        static bool matches(const std::string &pattern, const std::string &relativePath) {
+            std::string::size_type slash = relativePath.rfind('/');
+            const char *name = relativePath.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+
+            return fnmatch(pattern.c_str(), relativePath.c_str(), 0) == 0 ||
+                   fnmatch(pattern.c_str(), name, 0) == 0;
+        }
+
+        bool isExcluded(const std::string &relativePath) const {
+            for (const auto &pattern: excludes) {
+                if (matches(pattern, relativePath)) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        bool isIncluded(const std::string &relativePath) const {
+            if (isExcluded(relativePath)) {
+                return false;
+            }
+            if (includes.empty()) {
+                return true;
+            }
+            for (const auto &pattern: includes) {
+                if (matches(pattern, relativePath)) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+    };
+
+    struct TreeLeaf {
+        std::string relativePath;
+        char type;
+        std::string digest;
+    };
+
+    inline std::string parentOf(const std::string &relativePath) {
+        std::string::size_type slash = relativePath.rfind('/');
+
+        return slash == std::string::npos ? "" : relativePath.substr(0, slash);
+    }
+
+    inline std::string nameOf(const std::string &relativePath) {
+        std::string::size_type slash = relativePath.rfind('/');
+
+        return slash == std::string::npos ? relativePath : relativePath.substr(slash + 1);
+    }
+
+    /*
+     * Folds leaves, given by their path relative to the root, into one digest.
+     * Every directory node hashes its children in path order, so the root
+     * does not depend on the order the leaves were found in. Sorted by path,
+     * the entries of a directory are contiguous and one pass with a stack of
+     * open directories is enough.
+     */
+    inline std::string merkleRoot(std::vector<TreeLeaf> leaves, hash::Algorithm algorithm) {
+        std::sort(leaves.begin(), leaves.end(), [](const TreeLeaf &left, const TreeLeaf &right) {
+            return left.relativePath < right.relativePath;
+        });
+
+        struct OpenDirectory {
+            std::string path;
+            std::unique_ptr<hash::Hasher> hasher;
+        };
+        std::vector<OpenDirectory> openDirectories;
+        openDirectories.push_back({"", hash::createHasher(algorithm)});
+
+        auto addEntry = [](hash::Hasher &hasher, const std::string &name, char type, const std::string &digest) {
+            hasher.update(name.data(), name.size());
+            hasher.update("\0", 1);
+            hasher.update(&type, 1);
+            hasher.update(digest.data(), digest.size());
+            hasher.update("\n", 1);
+        };
+        auto closeDirectory = [&openDirectories, &addEntry]() {
+            OpenDirectory closed = std::move(openDirectories.back());
+            openDirectories.pop_back();
+            addEntry(*openDirectories.back().hasher, nameOf(closed.path), 'd', closed.hasher->finish());
+        };
+        auto contains = [](const std::string &directory, const std::string &path) {
+            return directory.empty() ||
+                   (path.size() > directory.size() &&
+                    path.compare(0, directory.size(), directory) == 0 &&
+                    path[directory.size()] == '/');
+        };
+
+        for (const auto &leaf: leaves) {
+            std::string directory = parentOf(leaf.relativePath);
+
+            while (openDirectories.back().path != directory && !contains(openDirectories.back().path, directory)) {
+                closeDirectory();
+            }
+            while (openDirectories.back().path != directory) {
+                const std::string &parent = openDirectories.back().path;
+                std::string::size_type next = directory.find('/', parent.empty() ? 0 : parent.size() + 1);
+                openDirectories.push_back({directory.substr(0, next), hash::createHasher(algorithm)});
+            }
+
+            addEntry(*openDirectories.back().hasher, nameOf(leaf.relativePath), leaf.type, leaf.digest);
+        }
+
+        while (openDirectories.size() > 1) {
+            closeDirectory();
+        }
+
+        return openDirectories.back().hasher->finish();
+    }
+
+    class TreeHasher {
+        const std::string root;
+        const TreeFilter &filter;
+        const hash::Algorithm algorithm;
+        FingerprintMemo *memo;
+        ThreadPool pool;
+        std::mutex leavesMutex;
+        std::vector<TreeLeaf> leaves;
+
+        void addLeaf(TreeLeaf leaf) {
+            std::lock_guard<std::mutex> lock(leavesMutex);
+            leaves.push_back(std::move(leaf));
+        }
+
+        void walk(const std::string &relativeDirectory) {
+            std::string directoryPath = relativeDirectory.empty() ? root : root + "/" + relativeDirectory;
+            DIR *directory = opendir(directoryPath.c_str());
+            if (directory == nullptr) {
+                throw std::invalid_argument("Cannot access directory " + directoryPath);
+            }
+
+            while (struct dirent *entry = readdir(directory)) {
+                std::string name(entry->d_name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+
+                std::string relativePath = relativeDirectory.empty() ? name : relativeDirectory + "/" + name;
+                std::string path = root + "/" + relativePath;
+                struct stat st{};
+                if (lstat(path.c_str(), &st) != 0) {
+                    closedir(directory);
+                    throw std::invalid_argument("Cannot access file " + path);
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                    if (!filter.isExcluded(relativePath)) {
+                        pool.submit([this, relativePath] { walk(relativePath); });
+                    }
+                } else if (S_ISLNK(st.st_mode)) {
+                    if (filter.isIncluded(relativePath)) {
+                        std::error_code errorCode;
+                        std::string target = stdfs::read_symlink(path, errorCode).string();
+                        if (errorCode) {
+                            closedir(directory);
+                            throw std::invalid_argument("Cannot read link " + path);
+                        }
+                        addLeaf({relativePath, 'l', hash::fromString(target, algorithm)});
+                    }
+                } else if (S_ISREG(st.st_mode)) {
+                    if (filter.isIncluded(relativePath)) {
+                        char type = (st.st_mode & S_IXUSR) ? 'x' : 'f';
+                        pool.submit([this, relativePath, path, type] {
+                            addLeaf({relativePath, type, fileDigest(path, algorithm, memo)});
+                        });
+                    }
+                }
+            }
+
+            closedir(directory);
+        }
+
+    public:
+        TreeHasher(std::string root, const TreeFilter &filter, hash::Algorithm algorithm, FingerprintMemo *memo) :
+                root(std::move(root)),
+                filter(filter),
+                algorithm(algorithm),
+                memo(memo),
+                pool(ThreadPool::defaultThreadCount(maximumTreeThreads)) {}
+
+        std::string run() {
+            pool.submit([this] { walk(""); });
+            pool.wait();
+
+            return merkleRoot(leaves, algorithm);
+        }
+    };
+
+    inline std::string fromDirectory(
+            const std::string &directory,
+            const TreeFilter &filter,
+            hash::Algorithm algorithm,
+            FingerprintMemo *memo = nullptr
+    ) {
+        std::string root(directory);
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+
+        return TreeHasher(root, filter, algorithm, memo).run();
+    }
+
+    /*
+     * Like fromDirectory, but takes the object ids of tracked files from the
+     * git index. Only files which differ from the index are read.
+     */
+    inline std::string fromGit(const std::string &path, const TreeFilter &filter, hash::Algorithm algorithm) {
+        std::vector<TreeLeaf> leaves;
+
+        for (auto &file: git::trackedFiles(path, ThreadPool::defaultThreadCount(maximumTreeThreads))) {
+            bool excluded = !filter.isIncluded(file.relativePath);
+            for (std::string directory = parentOf(file.relativePath);
+                 !excluded && !directory.empty();
+                 directory = parentOf(directory)) {
+                excluded = filter.isExcluded(directory);
+            }
+            if (!excluded) {
+                leaves.push_back({std::move(file.relativePath), file.type, std::move(file.objectId)});
+            }
+        }
+
+        return merkleRoot(leaves, algorithm);
+    }
+
+    /*
+     * The resolved packages of all lock files among the identity files.
+     */
+    inline std::vector<lockfile::Package> packagesOf(const std::vector<std::string> &files) {
+        std::vector<lockfile::Package> packages;
+
+        for (const auto &file: files) {
+            if (lockfile::formatOf(file) == lockfile::Format::unknown) {
+                continue;
+            }
+            std::vector<lockfile::Package> filePackages = lockfile::readPackages(file);
+            packages.insert(packages.end(), filePackages.begin(), filePackages.end());
+        }
+
+        std::sort(packages.begin(), packages.end());
+        packages.erase(std::unique(packages.begin(), packages.end()), packages.end());
+
+        return packages;
+    }
+}
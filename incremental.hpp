@@ -0,0 +1,169 @@
+#pragma once //"incremental.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "copyEngine.hpp"
+#include "hash.hpp"
+#include "manifest.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Brings an existing cache source to the state of a cache entry. The cache
+ * source is compared with the manifest of the entry: files of equal size and
+ * modification time are kept, files of equal size but another modification
+ * time are kept if their digest matches. Everything else is copied, paths
+ * the entry does not have are deleted. Files are never changed in place, as
+ * they may be hard links into the cache.
+ */
+namespace incremental {
+    struct Result {
+        size_t copied = 0;
+        size_t removed = 0;
+        size_t kept = 0;
+    };
+
+    inline bool isBelow(const std::string &path, const std::string &directory) {
+        return !directory.empty() &&
+               path.size() > directory.size() &&
+               path.compare(0, directory.size(), directory) == 0 &&
+               path[directory.size()] == '/';
+    }
+
+    inline bool sameModificationTime(const manifest::Record &left, const manifest::Record &right) {
+        return left.modificationSeconds == right.modificationSeconds &&
+               left.modificationNanoseconds == right.modificationNanoseconds;
+    }
+
+    inline Result restore(
+            const std::string &entryDirectory,
+            const std::string &cacheSource,
+            const std::vector<manifest::Record> &records,
+            size_t threadCount
+    ) {
+        Result result;
+        std::vector<manifest::Record> current;
+        struct stat st{};
+
+        // a link of the link mode or anything else which is not a directory is replaced
+        if (lstat(cacheSource.c_str(), &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                current = manifest::scan(cacheSource, threadCount);
+            } else {
+                stdfs::remove(cacheSource);
+            }
+        }
+
+        std::vector<manifest::Record> pending;
+        std::vector<std::string> removals;
+        std::vector<const manifest::Record *> candidates;
+        std::string removedDirectory;
+        size_t wanted = 0;
+        size_t present = 0;
+
+        while (wanted < records.size() || present < current.size()) {
+            if (present < current.size() && isBelow(current[present].path, removedDirectory)) {
+                present++;
+                continue;
+            }
+
+            int comparison = wanted == records.size() ? 1
+                             : present == current.size() ? -1
+                             : records[wanted].path.compare(current[present].path);
+            if (comparison < 0) {
+                pending.push_back(records[wanted++]);
+                continue;
+            }
+            if (comparison > 0) {
+                removals.push_back(current[present].path);
+                if (current[present].isDirectory()) {
+                    removedDirectory = current[present].path;
+                }
+                present++;
+                continue;
+            }
+
+            const manifest::Record &record = records[wanted++];
+            const manifest::Record &existing = current[present++];
+            if ((record.mode & S_IFMT) != (existing.mode & S_IFMT)) {
+                removals.push_back(existing.path);
+                if (existing.isDirectory()) {
+                    removedDirectory = existing.path;
+                }
+                pending.push_back(record);
+            } else if (record.isDirectory()) {
+                // existing directories are kept, only their permissions are set again
+                pending.push_back(record);
+            } else if (record.isSymlink()) {
+                if (record.linkTarget != existing.linkTarget) {
+                    removals.push_back(existing.path);
+                    pending.push_back(record);
+                } else {
+                    result.kept++;
+                }
+            } else if (record.size != existing.size || record.mode != existing.mode) {
+                removals.push_back(existing.path);
+                pending.push_back(record);
+            } else if (sameModificationTime(record, existing)) {
+                result.kept++;
+            } else {
+                candidates.push_back(&record);
+            }
+        }
+
+        // files touched without a change only get their modification time back
+        std::vector<char> changed(candidates.size(), 0);
+        if (!candidates.empty()) {
+            ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+            for (size_t i = 0; i < candidates.size(); i++) {
+                pool.submit([&, i] {
+                    std::string path = cacheSource + "/" + candidates[i]->path;
+                    changed[i] = hash::fromFile(path, hash::Algorithm::blake3) != candidates[i]->digest;
+                    if (!changed[i]) {
+                        const struct timespec times[2] = {
+                                {candidates[i]->modificationSeconds, candidates[i]->modificationNanoseconds},
+                                {candidates[i]->modificationSeconds, candidates[i]->modificationNanoseconds}
+                        };
+                        changed[i] = utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0;
+                    }
+                });
+            }
+            pool.wait();
+        }
+        for (size_t i = 0; i < candidates.size(); i++) {
+            if (changed[i]) {
+                removals.push_back(candidates[i]->path);
+                pending.push_back(*candidates[i]);
+            } else {
+                result.kept++;
+            }
+        }
+        std::sort(pending.begin(), pending.end(), [](const manifest::Record &left, const manifest::Record &right) {
+            return left.path < right.path;
+        });
+
+        for (const auto &removal: removals) {
+            std::error_code errorCode;
+            stdfs::remove_all(cacheSource + "/" + removal, errorCode);
+            if (errorCode) {
+                throw std::runtime_error("Cannot remove " + removal);
+            }
+        }
+        result.removed = removals.size();
+
+        copyEngine::copyTree(entryDirectory, cacheSource, threadCount, &pending);
+        for (const auto &record: pending) {
+            if (!record.isDirectory()) {
+                result.copied++;
+            }
+        }
+
+        return result;
+    }
+}
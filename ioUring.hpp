@@ -0,0 +1,275 @@
+#pragma once //"ioUring.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+
+#if HAS_LIBURING
+#include <liburing.h>
+#endif
+
+/*
+ * Writes many small files with few syscalls. A batch opens all files with
+ * one submission to io_uring, reads and writes them with the next and
+ * closes them with a third one, at most queueDepth requests are in flight.
+ * Files which fail are handed back to be written the usual way. Without
+ * liburing, or if the kernel does not support it, every file is handed back.
+ */
+namespace uring {
+    const unsigned queueDepth = 128;
+    const off_t smallFileSize = 64 * 1024;
+
+    /*
+     * A file to write: the content of the source file, or the data if there
+     * is no source. Mode and times are taken from the stat data.
+     */
+    struct Item {
+        std::string source;
+        std::string target;
+        struct stat st;
+        std::string data;
+    };
+
+#if HAS_LIBURING
+    inline bool available() {
+        static const bool supported = [] {
+            struct io_uring ring{};
+            if (io_uring_queue_init(8, &ring, 0) != 0) {
+                return false;
+            }
+            io_uring_queue_exit(&ring);
+
+            struct io_uring_probe *probe = io_uring_get_probe();
+            if (probe == nullptr) {
+                return false;
+            }
+            bool result = io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+                          io_uring_opcode_supported(probe, IORING_OP_READ) &&
+                          io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+                          io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+            io_uring_free_probe(probe);
+
+            return result;
+        }();
+
+        return supported;
+    }
+
+    class Batch {
+        enum Operation : unsigned {
+            sourceOperation = 0,
+            targetOperation = 1,
+            readOperation = 2,
+            writeOperation = 3,
+        };
+
+        struct Request {
+            Item item;
+            int sourceDescriptor = -1;
+            int targetDescriptor = -1;
+            bool failed = false;
+        };
+
+        struct io_uring ring{};
+        bool ready = false;
+        std::vector<Request> requests;
+
+        struct io_uring_sqe *nextSqe(size_t index, Operation operation) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            if (sqe == nullptr) {
+                throw std::runtime_error("io_uring submission queue is full");
+            }
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(static_cast<uintptr_t>(index << 2 | operation)));
+
+            return sqe;
+        }
+
+        template<typename Handler>
+        void complete(unsigned submitted, Handler handler) {
+            if (submitted == 0) {
+                return;
+            }
+            int result = io_uring_submit_and_wait(&ring, submitted);
+            if (result < 0 || static_cast<unsigned>(result) != submitted) {
+                throw std::runtime_error("Cannot submit to io_uring");
+            }
+
+            for (unsigned i = 0; i < submitted; i++) {
+                struct io_uring_cqe *cqe = nullptr;
+                if (io_uring_wait_cqe(&ring, &cqe) != 0) {
+                    throw std::runtime_error("Cannot wait for io_uring");
+                }
+                auto data = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe));
+                handler(static_cast<size_t>(data >> 2), static_cast<Operation>(data & 3), cqe->res);
+                io_uring_cqe_seen(&ring, cqe);
+            }
+        }
+
+        void openFiles() {
+            unsigned submitted = 0;
+            for (size_t i = 0; i < requests.size(); i++) {
+                const Item &item = requests[i].item;
+                if (!item.source.empty()) {
+                    io_uring_prep_openat(nextSqe(i, sourceOperation), AT_FDCWD, item.source.c_str(),
+                                         O_RDONLY | O_CLOEXEC, 0);
+                    submitted++;
+                }
+                io_uring_prep_openat(nextSqe(i, targetOperation), AT_FDCWD, item.target.c_str(),
+                                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                submitted++;
+            }
+
+            complete(submitted, [this](size_t index, Operation operation, int result) {
+                Request &request = requests[index];
+                if (result < 0) {
+                    request.failed = true;
+                } else if (operation == sourceOperation) {
+                    request.sourceDescriptor = result;
+                } else {
+                    request.targetDescriptor = result;
+                }
+            });
+        }
+
+        // a short read breaks the link, so the write of a file which shrank is canceled
+        void transferFiles() {
+            unsigned submitted = 0;
+            for (size_t i = 0; i < requests.size(); i++) {
+                Request &request = requests[i];
+                Item &item = request.item;
+                if (request.failed) {
+                    continue;
+                }
+                if (!item.source.empty()) {
+                    item.data.resize(static_cast<size_t>(item.st.st_size));
+                }
+                if (item.data.empty()) {
+                    continue;
+                }
+                if (!item.source.empty()) {
+                    struct io_uring_sqe *sqe = nextSqe(i, readOperation);
+                    io_uring_prep_read(sqe, request.sourceDescriptor, &item.data[0], item.data.size(), 0);
+                    sqe->flags |= IOSQE_IO_LINK;
+                    submitted++;
+                }
+                io_uring_prep_write(nextSqe(i, writeOperation), request.targetDescriptor, item.data.data(),
+                                    item.data.size(), 0);
+                submitted++;
+            }
+
+            complete(submitted, [this](size_t index, Operation, int result) {
+                Request &request = requests[index];
+                if (result < 0 || static_cast<size_t>(result) != request.item.data.size()) {
+                    request.failed = true;
+                }
+            });
+        }
+
+        void closeFiles() {
+            unsigned submitted = 0;
+            for (size_t i = 0; i < requests.size(); i++) {
+                if (requests[i].sourceDescriptor >= 0) {
+                    io_uring_prep_close(nextSqe(i, sourceOperation), requests[i].sourceDescriptor);
+                    submitted++;
+                }
+                if (requests[i].targetDescriptor >= 0) {
+                    io_uring_prep_close(nextSqe(i, targetOperation), requests[i].targetDescriptor);
+                    submitted++;
+                }
+            }
+
+            complete(submitted, [](size_t, Operation, int) {});
+        }
+
+    public:
+        static constexpr size_t capacity = queueDepth / 2;
+
+        Batch() {
+            ready = available() && io_uring_queue_init(queueDepth, &ring, 0) == 0;
+        }
+
+        ~Batch() {
+            if (ready) {
+                io_uring_queue_exit(&ring);
+            }
+        }
+
+        Batch(const Batch &) = delete;
+
+        Batch &operator=(const Batch &) = delete;
+
+        bool full() const {
+            return requests.size() >= capacity;
+        }
+
+        void add(Item item) {
+            Request request;
+            request.item = std::move(item);
+            requests.push_back(std::move(request));
+        }
+
+        /*
+         * Writes the files and returns those which failed.
+         */
+        std::vector<Item> flush() {
+            std::vector<Item> failed;
+
+            if (ready && !requests.empty()) {
+                openFiles();
+                transferFiles();
+                // io_uring has no operations for permissions and times
+                for (auto &request: requests) {
+                    const struct timespec times[2] = {request.item.st.st_atim, request.item.st.st_mtim};
+                    if (!request.failed &&
+                        (fchmod(request.targetDescriptor, request.item.st.st_mode & 07777) != 0 ||
+                         futimens(request.targetDescriptor, times) != 0)) {
+                        request.failed = true;
+                    }
+                }
+                closeFiles();
+            }
+
+            for (auto &request: requests) {
+                if (!ready || request.failed) {
+                    failed.push_back(std::move(request.item));
+                }
+            }
+            requests.clear();
+
+            return failed;
+        }
+    };
+#else
+    inline bool available() {
+        return false;
+    }
+
+    class Batch {
+        std::vector<Item> items;
+
+    public:
+        static constexpr size_t capacity = queueDepth / 2;
+
+        bool full() const {
+            return items.size() >= capacity;
+        }
+
+        void add(Item item) {
+            items.push_back(std::move(item));
+        }
+
+        std::vector<Item> flush() {
+            std::vector<Item> failed;
+            failed.swap(items);
+
+            return failed;
+        }
+    };
+#endif
+}
@@ -0,0 +1,185 @@
+#pragma once //"keyLock.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+
+/*
+ * An flock on a lock file per cache key, so of several processes missing
+ * the same key only one runs the setup. The others poll for the lock and
+ * stop waiting as soon as the entry is complete. Restores hold the lock
+ * shared, so an entry in use is not evicted. Lock files of keys without
+ * an entry are deleted by gc while it holds them exclusively, a lock taken
+ * on a file no longer at its path is therefore dropped and taken again on
+ * the new file. The descriptor is closed on exec, setup commands do not
+ * inherit the lock.
+ */
+class KeyLock {
+public:
+    enum class Outcome {
+        locked,
+        finished,
+        timedOut,
+    };
+
+private:
+    static constexpr std::chrono::milliseconds firstPollInterval{50};
+    static constexpr std::chrono::milliseconds lastPollInterval{1000};
+    static constexpr std::chrono::seconds progressInterval{10};
+
+    const std::string lockFile;
+    int descriptor = -1;
+
+    void openFile() {
+        if (descriptor >= 0) {
+            return;
+        }
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(lockFile).parent_path(), errorCode);
+        descriptor = open(lockFile.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (descriptor < 0) {
+            throw std::runtime_error("Cannot open " + lockFile);
+        }
+    }
+
+    // false if the file was deleted or replaced since it was opened
+    bool isCurrent() const {
+        struct stat opened{};
+        struct stat current{};
+
+        return fstat(descriptor, &opened) == 0 && stat(lockFile.c_str(), &current) == 0 &&
+               opened.st_dev == current.st_dev && opened.st_ino == current.st_ino;
+    }
+
+    void reopen() {
+        release();
+        openFile();
+    }
+
+public:
+    explicit KeyLock(std::string lockFile) : lockFile(std::move(lockFile)) {
+    }
+
+    ~KeyLock() {
+        release();
+    }
+
+    KeyLock(const KeyLock &) = delete;
+
+    KeyLock &operator=(const KeyLock &) = delete;
+
+    bool isLocked() const {
+        return descriptor >= 0;
+    }
+
+    /*
+     * Waits for the lock at most the timeout. While waiting, finished is
+     * asked whether the other process completed the entry and progress is
+     * told the seconds waited so far every few seconds.
+     */
+    Outcome acquire(
+            std::chrono::seconds timeout,
+            const std::function<bool()> &finished,
+            const std::function<void(long long)> &progress
+    ) {
+        openFile();
+
+        const auto start = std::chrono::steady_clock::now();
+        auto nextProgress = start + progressInterval;
+        std::chrono::milliseconds pollInterval = firstPollInterval;
+
+        for (;;) {
+            if (flock(descriptor, LOCK_EX | LOCK_NB) == 0) {
+                if (isCurrent()) {
+                    return Outcome::locked;
+                }
+                reopen();
+                continue;
+            }
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                release();
+                throw std::runtime_error("Cannot lock " + lockFile);
+            }
+            if (finished()) {
+                release();
+                return Outcome::finished;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - start >= timeout) {
+                release();
+                return Outcome::timedOut;
+            }
+            if (now >= nextProgress) {
+                progress(std::chrono::duration_cast<std::chrono::seconds>(now - start).count());
+                nextProgress += progressInterval;
+            }
+
+            std::this_thread::sleep_for(pollInterval);
+            pollInterval = std::min(pollInterval * 2, lastPollInterval);
+        }
+    }
+
+    /*
+     * Takes the lock shared, waiting for an eviction of the entry. An
+     * exclusive lock of this process is turned into a shared one.
+     */
+    void share() {
+        openFile();
+        for (;;) {
+            if (flock(descriptor, LOCK_SH) == 0) {
+                if (isCurrent()) {
+                    return;
+                }
+                reopen();
+            } else if (errno != EINTR) {
+                release();
+                throw std::runtime_error("Cannot lock " + lockFile);
+            }
+        }
+    }
+
+    /*
+     * Takes the lock exclusively if no other process holds it.
+     */
+    bool tryExclusive() {
+        openFile();
+        while (flock(descriptor, LOCK_EX | LOCK_NB) == 0) {
+            if (isCurrent()) {
+                return true;
+            }
+            reopen();
+        }
+        release();
+
+        return false;
+    }
+
+    /*
+     * Deletes the lock file while it is held exclusively, and releases it.
+     */
+    void remove() {
+        if (descriptor >= 0) {
+            unlink(lockFile.c_str());
+        }
+        release();
+    }
+
+    void release() {
+        if (descriptor >= 0) {
+            close(descriptor);
+            descriptor = -1;
+        }
+    }
+};
@@ -0,0 +1,165 @@
+#pragma once //"lease.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "entryStats.hpp"
+#include "hash.hpp"
+#include "processOwner.hpp"
+#include "staging.hpp"
+
+/*
+ * A cache source linked into the cache destination holds a lease on its
+ * entry, so the entry is neither evicted nor moved while a build uses it.
+ * Every cache source has one lease file in ".cadir-leases", named by the
+ * md5 of its path, holding the entry, the expiry, the session leader of
+ * the process which ran cadir, usually the shell of the build job, and its
+ * host. A lease ends when it is released, when it expires or when its
+ * session leader on this host is gone. Ended leases are removed by whoever finds them.
+ */
+namespace lease {
+    const std::string leaseDirectory = ".cadir-leases";
+
+    struct Lease {
+        std::string entryName;
+        int64_t expires = 0;
+        pid_t holder = 0;
+        std::string host;
+        std::string cacheSource;
+    };
+
+    inline std::string path(const std::string &destination, const std::string &cacheSource) {
+        return (stdfs::path(destination) / leaseDirectory /
+                hash::fromString(staging::normalized(cacheSource).string(), hash::Algorithm::md5)).string();
+    }
+
+    inline bool read(const std::string &file, Lease &lease) {
+        std::ifstream stream(file);
+        std::string line;
+        if (!std::getline(stream, line)) {
+            return false;
+        }
+
+        std::istringstream fields(line);
+        std::string expires;
+        std::string holder;
+
+        if (!std::getline(fields, lease.entryName, '\t') ||
+            !std::getline(fields, expires, '\t') ||
+            !std::getline(fields, holder, '\t') ||
+            !std::getline(fields, lease.host, '\t') ||
+            !std::getline(fields, lease.cacheSource)) {
+            return false;
+        }
+        lease.expires = std::atoll(expires.c_str());
+        lease.holder = static_cast<pid_t>(std::atoi(holder.c_str()));
+
+        return true;
+    }
+
+    inline bool hasEnded(const Lease &lease) {
+        if (lease.expires <= static_cast<int64_t>(std::time(nullptr))) {
+            return true;
+        }
+
+        return lease.host == processOwner::hostName() && lease.holder > 0 && kill(lease.holder, 0) != 0 && errno == ESRCH;
+    }
+
+    /*
+     * Leases the entry for the cache source, replacing the lease the cache
+     * source held on another entry. Taken under the shared key lock of the
+     * entry, so no eviction runs in between.
+     */
+    inline void take(
+            const std::string &destination,
+            const std::string &entryName,
+            const std::string &cacheSource,
+            int64_t seconds
+    ) {
+        const int64_t expires = static_cast<int64_t>(std::time(nullptr)) + seconds;
+        // cadir started in a session of its own is held by its parent
+        pid_t holder = getsid(0);
+        if (holder == getpid() || holder < 0) {
+            holder = getppid();
+        }
+
+        entryStats::writeText(path(destination, cacheSource),
+                              entryName + '\t' + std::to_string(expires) + '\t' + std::to_string(holder) +
+                              '\t' + processOwner::hostName() + '\t' + staging::normalized(cacheSource).string() + '\n');
+    }
+
+    inline void release(const std::string &destination, const std::string &cacheSource) {
+        std::error_code errorCode;
+        stdfs::remove(path(destination, cacheSource), errorCode);
+    }
+
+    /*
+     * The entries under a lease which has not ended, read at once for many
+     * lookups, with the modification time of the lease directory before it
+     * was read. A lease taken since changes that time.
+     */
+    struct Leases {
+        std::set<std::string> entryNames;
+        struct timespec modified{};
+    };
+
+    inline struct timespec directoryModified(const std::string &destination) {
+        struct stat st{};
+        if (stat((stdfs::path(destination) / leaseDirectory).c_str(), &st) != 0) {
+            return {};
+        }
+
+        return st.st_mtim;
+    }
+
+    /*
+     * Reads all leases, ended leases found on the way are removed.
+     */
+    inline Leases readAll(const std::string &destination) {
+        Leases leases;
+        leases.modified = directoryModified(destination);
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(stdfs::path(destination) / leaseDirectory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            Lease lease;
+            if (!read(iterator->path().string(), lease)) {
+                continue;
+            }
+            if (hasEnded(lease)) {
+                std::error_code removeErrorCode;
+                stdfs::remove(iterator->path(), removeErrorCode);
+            } else {
+                leases.entryNames.insert(lease.entryName);
+            }
+        }
+
+        return leases;
+    }
+
+    /*
+     * Whether a lease on the entry has not ended, by the leases read before.
+     * They are read again only if the lease directory changed since, one
+     * stat per lookup instead of reading every lease file. Called under the
+     * exclusive key lock of the entry.
+     */
+    inline bool isLeased(const std::string &destination, const std::string &entryName, Leases &leases) {
+        const struct timespec modified = directoryModified(destination);
+        if (modified.tv_sec != leases.modified.tv_sec || modified.tv_nsec != leases.modified.tv_nsec) {
+            leases = readAll(destination);
+        }
+
+        return leases.entryNames.count(entryName) > 0;
+    }
+}
@@ -0,0 +1,519 @@
+#pragma once //"lockfile.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "hash.hpp"
+
+namespace lockfile {
+    /*
+     * Minimal JSON reader for lock files. Strings are scanned with memchr,
+     * which glibc implements with SIMD instructions.
+     */
+    namespace json {
+        struct Value {
+            enum class Type {
+                null,
+                boolean,
+                number,
+                string,
+                array,
+                object,
+            };
+
+            Type type = Type::null;
+            std::string text;
+            std::vector<std::pair<std::string, Value>> members;
+            std::vector<Value> items;
+
+            const Value *find(const std::string &key) const {
+                for (const auto &member: members) {
+                    if (member.first == key) {
+                        return &member.second;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            std::string stringOf(const std::string &key) const {
+                const Value *value = find(key);
+
+                return (value != nullptr && value->type == Type::string) ? value->text : "";
+            }
+
+            bool isTrue(const std::string &key) const {
+                const Value *value = find(key);
+
+                return value != nullptr && value->type == Type::boolean && value->text == "true";
+            }
+        };
+
+        class Parser {
+            const char *position;
+            const char *const end;
+
+            [[noreturn]] static void fail() {
+                throw std::invalid_argument("Invalid JSON");
+            }
+
+            void skipWhitespace() {
+                while (position < end &&
+                       (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t')) {
+                    position++;
+                }
+            }
+
+            void expect(char character) {
+                skipWhitespace();
+                if (position >= end || *position != character) {
+                    fail();
+                }
+                position++;
+            }
+
+            static void appendUtf8(std::string &target, unsigned long codePoint) {
+                if (codePoint < 0x80) {
+                    target.push_back(static_cast<char>(codePoint));
+                } else if (codePoint < 0x800) {
+                    target.push_back(static_cast<char>(0xc0 | (codePoint >> 6)));
+                    target.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+                } else if (codePoint < 0x10000) {
+                    target.push_back(static_cast<char>(0xe0 | (codePoint >> 12)));
+                    target.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+                    target.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+                } else {
+                    target.push_back(static_cast<char>(0xf0 | (codePoint >> 18)));
+                    target.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f)));
+                    target.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+                    target.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+                }
+            }
+
+            unsigned long readHex4() {
+                if (end - position < 4) {
+                    fail();
+                }
+                std::string digits(position, 4);
+                if (digits.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+                    fail();
+                }
+                position += 4;
+
+                return std::stoul(digits, nullptr, 16);
+            }
+
+            std::string parseString() {
+                expect('"');
+                std::string result;
+
+                for (;;) {
+                    const char *quote = static_cast<const char *>(memchr(position, '"', end - position));
+                    if (quote == nullptr) {
+                        fail();
+                    }
+                    const char *escape = static_cast<const char *>(memchr(position, '\\', quote - position));
+                    if (escape == nullptr) {
+                        result.append(position, quote);
+                        position = quote + 1;
+
+                        return result;
+                    }
+
+                    result.append(position, escape);
+                    position = escape + 1;
+                    if (position >= end) {
+                        fail();
+                    }
+                    switch (*position++) {
+                        case '"': result.push_back('"'); break;
+                        case '\\': result.push_back('\\'); break;
+                        case '/': result.push_back('/'); break;
+                        case 'b': result.push_back('\b'); break;
+                        case 'f': result.push_back('\f'); break;
+                        case 'n': result.push_back('\n'); break;
+                        case 'r': result.push_back('\r'); break;
+                        case 't': result.push_back('\t'); break;
+                        case 'u': {
+                            unsigned long codePoint = readHex4();
+                            if (codePoint >= 0xd800 && codePoint < 0xdc00 &&
+                                end - position >= 6 && position[0] == '\\' && position[1] == 'u') {
+                                position += 2;
+                                unsigned long low = readHex4();
+                                codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+                            }
+                            appendUtf8(result, codePoint);
+                            break;
+                        }
+                        default:
+                            fail();
+                    }
+                }
+            }
+
+            Value parseValue() {
+                skipWhitespace();
+                if (position >= end) {
+                    fail();
+                }
+
+                Value value;
+                switch (*position) {
+                    case '{':
+                        value.type = Value::Type::object;
+                        position++;
+                        skipWhitespace();
+                        if (position < end && *position == '}') {
+                            position++;
+                            return value;
+                        }
+                        for (;;) {
+                            std::string key = parseString();
+                            expect(':');
+                            value.members.emplace_back(std::move(key), parseValue());
+                            skipWhitespace();
+                            if (position < end && *position == ',') {
+                                position++;
+                                continue;
+                            }
+                            expect('}');
+                            return value;
+                        }
+                    case '[':
+                        value.type = Value::Type::array;
+                        position++;
+                        skipWhitespace();
+                        if (position < end && *position == ']') {
+                            position++;
+                            return value;
+                        }
+                        for (;;) {
+                            value.items.push_back(parseValue());
+                            skipWhitespace();
+                            if (position < end && *position == ',') {
+                                position++;
+                                continue;
+                            }
+                            expect(']');
+                            return value;
+                        }
+                    case '"':
+                        value.type = Value::Type::string;
+                        value.text = parseString();
+                        return value;
+                    default: {
+                        const char *start = position;
+                        while (position < end && (isalnum(static_cast<unsigned char>(*position)) ||
+                                                  *position == '-' || *position == '+' || *position == '.')) {
+                            position++;
+                        }
+                        value.text.assign(start, position);
+                        if (value.text == "null") {
+                            value.type = Value::Type::null;
+                        } else if (value.text == "true" || value.text == "false") {
+                            value.type = Value::Type::boolean;
+                        } else if (!value.text.empty()) {
+                            value.type = Value::Type::number;
+                        } else {
+                            fail();
+                        }
+                        return value;
+                    }
+                }
+            }
+
+        public:
+            Parser(const char *begin, const char *end) : position(begin), end(end) {}
+
+            Value parse() {
+                Value value = parseValue();
+                skipWhitespace();
+                if (position != end) {
+                    fail();
+                }
+
+                return value;
+            }
+        };
+
+        inline Value parse(const std::string &content) {
+            return Parser(content.data(), content.data() + content.size()).parse();
+        }
+    }
+
+    /*
+     * A resolved package: where it is installed, its version, what
+     * identifies its content (integrity, checksum or reference) and the
+     * section it belongs to, e.g. "require-dev" or npm's "dev,optional",
+     * which decides whether an install without dev packages installs it.
+     */
+    struct Package {
+        std::string name;
+        std::string version;
+        std::string integrity;
+        std::string section;
+
+        bool operator<(const Package &other) const {
+            return std::tie(name, version, integrity, section) <
+                   std::tie(other.name, other.version, other.integrity, other.section);
+        }
+
+        bool operator==(const Package &other) const {
+            return name == other.name && version == other.version && integrity == other.integrity &&
+                   section == other.section;
+        }
+    };
+
+    enum class Format {
+        unknown,
+        composer,
+        npm,
+        yarn,
+    };
+
+    inline Format formatOf(const std::string &path) {
+        std::string::size_type slash = path.rfind('/');
+        std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+        if (name == "composer.lock") return Format::composer;
+        if (name == "package-lock.json" || name == "npm-shrinkwrap.json") return Format::npm;
+        if (name == "yarn.lock") return Format::yarn;
+
+        return Format::unknown;
+    }
+
+    inline std::string readFile(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.good()) {
+            throw std::invalid_argument("Cannot access file");
+        }
+
+        std::ostringstream content;
+        content << file.rdbuf();
+
+        return content.str();
+    }
+
+    inline void composerPackages(const json::Value &root, std::vector<Package> &packages) {
+        for (const char *section: {"packages", "packages-dev"}) {
+            const std::string sectionName = std::string(section) == "packages" ? "require" : "require-dev";
+            const json::Value *list = root.find(section);
+            if (list == nullptr) {
+                continue;
+            }
+            for (const auto &item: list->items) {
+                std::string reference;
+                for (const char *origin: {"dist", "source"}) {
+                    const json::Value *source = item.find(origin);
+                    if (source != nullptr && reference.empty()) {
+                        reference = source->stringOf("reference");
+                        if (reference.empty()) {
+                            reference = source->stringOf("shasum");
+                        }
+                    }
+                }
+                packages.push_back({item.stringOf("name"), item.stringOf("version"), reference, sectionName});
+            }
+        }
+    }
+
+    // the flags npm ci --omit decides by, in a fixed order
+    inline std::string npmFlags(const json::Value &package) {
+        std::string flags;
+        for (const char *flag: {"dev", "optional", "devOptional", "peer"}) {
+            if (package.isTrue(flag)) {
+                flags += (flags.empty() ? "" : ",") + std::string(flag);
+            }
+        }
+
+        return flags;
+    }
+
+    inline void npmDependencies(const json::Value &dependencies, const std::string &parent,
+                                std::vector<Package> &packages) {
+        for (const auto &dependency: dependencies.members) {
+            std::string path = parent + "node_modules/" + dependency.first;
+            std::string integrity = dependency.second.stringOf("integrity");
+
+            packages.push_back({
+                    path,
+                    dependency.second.stringOf("version"),
+                    integrity.empty() ? dependency.second.stringOf("resolved") : integrity,
+                    npmFlags(dependency.second)
+            });
+
+            const json::Value *nested = dependency.second.find("dependencies");
+            if (nested != nullptr) {
+                npmDependencies(*nested, path + "/", packages);
+            }
+        }
+    }
+
+    inline void npmPackages(const json::Value &root, std::vector<Package> &packages) {
+        const json::Value *installed = root.find("packages");
+
+        // lockfileVersion 2 and 3 list every installed path, the root project has an empty one
+        if (installed != nullptr) {
+            for (const auto &package: installed->members) {
+                if (package.first.empty()) {
+                    continue;
+                }
+                std::string integrity = package.second.stringOf("integrity");
+
+                packages.push_back({
+                        package.first,
+                        package.second.stringOf("version"),
+                        integrity.empty() ? package.second.stringOf("resolved") : integrity,
+                        npmFlags(package.second)
+                });
+            }
+
+            return;
+        }
+
+        const json::Value *dependencies = root.find("dependencies");
+        if (dependencies != nullptr) {
+            npmDependencies(*dependencies, "", packages);
+        }
+    }
+
+    inline std::string unquote(std::string value) {
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\r')) {
+            value.pop_back();
+        }
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            return value.substr(1, value.size() - 2);
+        }
+
+        return value;
+    }
+
+    inline std::string yarnPackageName(const std::string &descriptors) {
+        std::string first = descriptors.substr(0, descriptors.find(','));
+        first.erase(0, first.find_first_not_of(" \""));
+        first.erase(first.find_last_not_of(" \"") + 1);
+        if (first.empty()) {
+            return first;
+        }
+        std::string::size_type at = first.find('@', first.front() == '@' ? 1 : 0);
+
+        return at == std::string::npos ? first : first.substr(0, at);
+    }
+
+    /*
+     * Reads yarn.lock of yarn 1 ('version "1.0.0"') and of yarn 2 and later
+     * ('version: 1.0.0'). Only the indented fields directly below an entry are used.
+     */
+    inline void yarnPackages(const std::string &content, std::vector<Package> &packages) {
+        std::istringstream lines(content);
+        std::string line;
+        Package current;
+        bool inEntry = false;
+
+        auto flush = [&packages, &current, &inEntry]() {
+            if (inEntry && current.name != "__metadata") {
+                packages.push_back(current);
+            }
+            current = Package();
+            inEntry = false;
+        };
+
+        while (std::getline(lines, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            if (line[0] != ' ') {
+                flush();
+                if (line.back() == ':') {
+                    current.name = yarnPackageName(line.substr(0, line.size() - 1));
+                    inEntry = true;
+                }
+                continue;
+            }
+            if (line.size() < 3 || line[2] == ' ') {
+                continue;
+            }
+
+            std::string field = line.substr(2);
+            std::string::size_type separator = field.find_first_of(": ");
+            if (separator == std::string::npos) {
+                continue;
+            }
+            std::string key = field.substr(0, separator);
+            std::string::size_type valueStart = field.find_first_not_of(": ", separator);
+            std::string value = (valueStart == std::string::npos) ? "" : unquote(field.substr(valueStart));
+
+            if (key == "version") {
+                current.version = value;
+            } else if (key == "integrity" || key == "checksum") {
+                current.integrity = value;
+            } else if ((key == "resolved" || key == "resolution") && current.integrity.empty()) {
+                current.integrity = value;
+            }
+        }
+        flush();
+    }
+
+    /*
+     * The resolved package set of a lock file, sorted and without duplicates.
+     */
+    inline std::vector<Package> readPackages(const std::string &path) {
+        Format format = formatOf(path);
+        std::string content = readFile(path);
+        std::vector<Package> packages;
+
+        try {
+            switch (format) {
+                case Format::composer:
+                    composerPackages(json::parse(content), packages);
+                    break;
+                case Format::npm:
+                    npmPackages(json::parse(content), packages);
+                    break;
+                case Format::yarn:
+                    yarnPackages(content, packages);
+                    break;
+                default:
+                    throw std::invalid_argument("Unknown lock file format");
+            }
+        } catch (std::invalid_argument &) {
+            throw std::invalid_argument("Cannot parse lock file " + path);
+        }
+
+        std::sort(packages.begin(), packages.end());
+        packages.erase(std::unique(packages.begin(), packages.end()), packages.end());
+
+        return packages;
+    }
+
+    /*
+     * Digest of the resolved packages only. Formatting, key order and
+     * metadata which does not change the installed files do not change it.
+     */
+    inline std::string semanticDigest(const std::string &path, hash::Algorithm algorithm) {
+        auto hasher = hash::createHasher(algorithm);
+
+        for (const auto &package: readPackages(path)) {
+            hasher->update(package.name.data(), package.name.size());
+            hasher->update("\0", 1);
+            hasher->update(package.version.data(), package.version.size());
+            hasher->update("\0", 1);
+            hasher->update(package.integrity.data(), package.integrity.size());
+            // yarn.lock has no sections, its digests stay as they were
+            if (!package.section.empty()) {
+                hasher->update("\0", 1);
+                hasher->update(package.section.data(), package.section.size());
+            }
+            hasher->update("\n", 1);
+        }
+
+        return hasher->finish();
+    }
+}
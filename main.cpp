@@ -1,12 +1,10 @@
 #include <cstring>
 #include <iostream>
 #include <fstream>
-#include <utime.h>
 #include <chrono>
 #include <array>
 #include <config.h>
 #include "buildNumber.hpp"
-#include "openssl/md5.h"
 #include "CLI11.hpp"
 #include "Exceptions/SetupCommandException.h"
 #include "Exceptions/FinalizeCommandException.h"
@@ -16,25 +14,32 @@
 #include "Exceptions/CopyFromCacheException.h"
 #include "Exceptions/LinkFromCacheException.h"
 #include "compress.hpp"
-
-const std::string archiveExtension = ".tar.gz";
+#include "copyEngine.hpp"
+#include "manifest.hpp"
+#include "hash.hpp"
+#include "identity.hpp"
+#include "cacheKey.hpp"
+#include "store.hpp"
+#include "contentStore.hpp"
+#include "hardlink.hpp"
+#include "eviction.hpp"
+#include "incremental.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "staging.hpp"
+
+const std::string archiveExtension = store::archiveExtension;
+const std::string fingerprintMemoFileName = ".cadir-fingerprints";
 
 const int currentWorkingDirectoryArgument = 0;
-const auto defaultCopyOptions = stdfs::copy_options::recursive |
-                                stdfs::copy_options::overwrite_existing |
-                                stdfs::copy_options::copy_symlinks;
 
-const std::string CADIRVERSION = "1.1.1";
+const std::string CADIRVERSION = "1.2.0";
 const std::string CADIRFULLVERSION = CADIRVERSION + "-" + getBuildNumber();
 
 bool verbose = false;
 
 void showHelpText(const std::string &help);
 
-std::string generateMd5FromString(const std::string &content);
-
-std::string getFileContents(const std::string &fileName);
-
 std::string generatePath(std::string &directory, const std::string &name);
 
 bool isAbsolutePath(const std::string &directory);
@@ -49,28 +54,55 @@ void trace(const std::string &log, bool const &force = false);
 
 void trace(bool const &force = false);
 
+void copyFromEntry(
+        const std::string &entryPath,
+        const std::string &cacheSource,
+        const std::string &manifestFile,
+        size_t jobs
+);
+
+bool seedFromEntry(
+        const std::string &cacheDestination,
+        const store::Entry &entry,
+        const std::string &cacheSource,
+        const std::string &manifestFile,
+        const bool &archive,
+        size_t jobs
+);
+
 void createCache(
         const std::string &setupCommand,
         const std::string &cacheSource,
         const std::string &commandString,
         const std::string &targetDirectoryPath,
-        const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const std::string &blobDirectory,
+        const std::string &manifestFile,
+        const std::string &cacheDestination,
+        bool admit,
+        size_t jobs
 );
 
 void loadFromCache(
         const std::string &cacheSource,
         const std::string &currentWorkingDirectoryPath,
         bool linkCache,
+        bool hardlinkCache,
+        bool incrementalRestore,
+        const std::vector<std::string> &privateCopyPatterns,
         const std::string &commandString,
         const std::string &targetDirectoryPath,
-        const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const std::string &manifestFile,
+        const bool &archive,
+        size_t jobs
 );
 
 int main(int argumentCount, char **argumentList) {
     try {
-        std::string identityFile;
+        std::vector<std::string> identityFiles;
+        std::string identityDirectory;
+        std::string identityGitPath;
+        identity::TreeFilter identityFilter;
         std::string commandWorkingDirectory;
         std::string setupCommand;
         std::string finalizeCommand;
@@ -79,29 +111,111 @@ int main(int argumentCount, char **argumentList) {
         std::string currentWorkingDirectoryPath(
                 removeLastStringAfterSlash(argumentList[currentWorkingDirectoryArgument]));
         std::string generatedHashTargetDirectory;
+        std::string hashAlgorithmName = hash::defaultAlgorithmName;
+        std::string identityModeName = "content";
+        std::string keyTemplate = cacheKey::defaultTemplate;
+        std::string keyCommand;
+        std::vector<std::string> restoreKeys;
+        bool seedNearest = false;
+        std::vector<lockfile::Package> identityPackages;
         bool linkCache = false;
+        bool hardlinkCache = false;
+        bool incrementalRestore = false;
+        std::vector<std::string> privateCopyPatterns;
         bool showHelp = false;
         bool showVersion = false;
         bool showCacheHit = false;
         bool archive = false;
+        bool noFingerprintMemo = false;
+        bool dedupe = false;
+        size_t jobs = 0;
+        size_t lockTimeout = 1800;
+        eviction::Budget budget;
+        std::string evictionPolicyName = "gds";
+        size_t admitAfter = 1;
+        bool shardStore = false;
+        size_t leaseDuration = 3600;
+        std::vector<std::string> removeTrees;
 
         CLI::App app{"cadir description", "cadir"};
         app.remove_option(app.get_help_ptr());
 
         app.add_option("--cache-source", cacheSource, "The directory which should be cached");
-        app.add_option("--identity-file", identityFile, "File which shows differences");
+        app.add_option("--identity-file", identityFiles,
+                       "File which shows differences, could be repeated and contain glob patterns");
+        app.add_option("--identity-mode", identityModeName,
+                       "[optional] content (default) hashes identity files as they are, semantic hashes only the "
+                       "resolved packages of composer.lock, package-lock.json and yarn.lock")
+                ->check(CLI::IsMember({"content", "semantic"}));
+        app.add_option("--identity-dir", identityDirectory,
+                       "[optional] Directory whose content shows differences, instead of or additional to identity files");
+        app.add_option("--identity-git", identityGitPath,
+                       "[optional] Path in a git work tree, its tracked files show differences by their git object ids");
+        app.add_option("--identity-include", identityFilter.includes,
+                       "[optional] Pattern of files in the identity directory to hash, could be repeated");
+        app.add_option("--identity-exclude", identityFilter.excludes,
+                       "[optional] Pattern of files or directories in the identity directory to skip, could be repeated");
+        app.add_option("--key-template", keyTemplate,
+                       "[optional] Name of the cache entry, placeholders: {hash}, {os}, {arch}, {env:NAME}");
+        app.add_option("--key-command", keyCommand,
+                       "[optional] Command whose output is mixed into the hash of the cache key");
+        app.add_option("--restore-key", restoreKeys,
+                       "[optional] Key prefix of a cache to start from if the cache is not found, could be repeated");
+        app.add_flag("--seed-nearest", seedNearest,
+                     "On a miss start from the cache sharing the most packages with the identity lock files");
         app.add_option("--cache-destination", targetCacheDirectoryPath, "The directory where the cache is stored");
         app.add_option("--command-working-directory", commandWorkingDirectory,
                        "Working directory where the setup command is called from");
         app.add_option("--setup", setupCommand, "Argument which is called if cache is not found");
         app.add_option("--finalize", finalizeCommand,
                        "[optional] Command which is called after cache is regenerated, linked or copied");
+        app.add_option("--hash-algorithm", hashAlgorithmName,
+                       "[optional] Algorithm of the cache key: md5 (default), sha256, xxh3 or blake3")
+                ->check(CLI::IsMember({"md5", "sha256", "xxh3", "blake3"}));
         app.add_flag("-a,--archive", archive, "In case of copying the data a tar compressed archive will be created");
+        app.add_flag("--dedupe", dedupe,
+                     "Store every file content once and build caches of hard links to it, not with --archive");
+        app.add_option("--jobs", jobs,
+                       "[optional] Number of threads copying files, default twice the cores, at least 4 and at most 32");
+        app.add_option("--lock-timeout", lockTimeout,
+                       "[optional] Seconds to wait for another cadir creating the same cache, default 1800, 0 does not wait");
+        app.add_option("--max-cache-size", budget.maximumSize,
+                       "[optional] Size of the cache destination, e.g. 20G, least recently used caches are evicted")
+                ->transform(CLI::AsSizeValue(false));
+        app.add_option("--max-entries", budget.maximumEntries,
+                       "[optional] Number of caches in the cache destination, least recently used caches are evicted");
+        app.add_option("--eviction-policy", evictionPolicyName,
+                       "[optional] gds (default) evicts the caches saving the least setup time per byte first, "
+                       "lru the least recently used ones")
+                ->check(CLI::IsMember({"gds", "lru"}));
+        app.add_option("--admit-after", admitAfter,
+                       "[optional] Create a cache only after its key was missed this many times, default 1");
+        app.add_option("--lease-duration", leaseDuration,
+                       "[optional] Seconds a linked cache is protected from eviction unless released, default 3600, "
+                       "0 takes no lease");
+        app.add_flag("--shard-store", shardStore,
+                     "Move the caches into two levels of shard directories, later runs keep using them");
+        app.add_flag("--no-fingerprint-memo", noFingerprintMemo,
+                     "Always hash identity files instead of reusing checksums of unchanged files");
         app.add_flag("-v,--verbose", verbose, "Show verbose output");
-        app.add_flag("-l,--link", linkCache, "Link cache instead of copy");
+        auto linkOption = app.add_flag("-l,--link", linkCache, "Link cache instead of copy");
+        app.add_flag("--hardlink", hardlinkCache,
+                     "Restore the cache as hard links to its read-only files instead of copying it")
+                ->excludes(linkOption);
+        app.add_flag("--incremental", incrementalRestore,
+                     "Update an existing cache source to the cache, copying only changed files")
+                ->excludes(linkOption);
+        app.add_option("--hardlink-copy", privateCopyPatterns,
+                       "[optional] Pattern of files which get a writable copy instead of a hard link, could be repeated");
+        app.add_option(staging::removeOption, removeTrees, "Delete an old cache source in the background")
+                ->group("");
         app.add_flag("-h,--help", showHelp, "Show help");
         app.add_flag("-s,--show-cache-hit", showCacheHit, "Show if source was taken from the cache");
         app.add_flag("-V,--version", showVersion, "Show version");
+        auto gcCommand = app.add_subcommand("gc", "Evict least recently used caches of the cache destination");
+        gcCommand->fallthrough();
+        auto releaseCommand = app.add_subcommand("release", "Release the lease of a linked cache source on its cache");
+        releaseCommand->fallthrough();
 
         try {
             app.parse(argumentCount, argumentList);
@@ -121,6 +235,12 @@ int main(int argumentCount, char **argumentList) {
             return ExitCode::argumentParsingFailed;
         }
 
+        if (!removeTrees.empty()) {
+            staging::removeTrees(removeTrees, jobs);
+
+            return 0;
+        }
+
         if (showHelp) {
             showHelpText(app.help());
 
@@ -133,38 +253,272 @@ int main(int argumentCount, char **argumentList) {
             return 0;
         }
 
+        const eviction::Policy evictionPolicy = eviction::policyFromName(evictionPolicyName);
+
+        if (shardStore && !targetCacheDirectoryPath.empty()) {
+            try {
+                size_t moved = store::shard(targetCacheDirectoryPath, jobs);
+                trace("Moved " + std::to_string(moved) + " caches into shards", gcCommand->parsed());
+            } catch (std::exception &exception) {
+                trace(std::string(exception.what()), true);
+
+                return ExitCode::createCacheDirectoriesFailed;
+            }
+        }
+
+        if (*releaseCommand) {
+            if (cacheSource.empty() || targetCacheDirectoryPath.empty()) {
+                trace(std::string("release needs --cache-source and --cache-destination"), true);
+
+                return ExitCode::argumentParsingFailed;
+            }
+            lease::release(targetCacheDirectoryPath, cacheSource);
+
+            return ExitCode::ok;
+        }
+
+        if (*gcCommand) {
+            if (targetCacheDirectoryPath.empty()) {
+                trace(std::string("gc needs --cache-destination"), true);
+
+                return ExitCode::argumentParsingFailed;
+            }
+            eviction::Result result;
+            if (budget.isSet()) {
+                result = eviction::enforce(targetCacheDirectoryPath, budget, evictionPolicy, "", jobs);
+            }
+            // blobs left without entries by earlier evictions
+            result.freed += contentStore::collectGarbage(
+                    (stdfs::path(targetCacheDirectoryPath) / contentStore::blobDirectoryName).string(),
+                    jobs
+            );
+            size_t stale = eviction::removeStale(targetCacheDirectoryPath);
+            if (budget.isSet()) {
+                trace("Evicted " + std::to_string(result.evicted) + " caches of " + std::to_string(result.freed) +
+                      " bytes, kept " + std::to_string(result.kept) + " caches of " + std::to_string(result.size) +
+                      " bytes", true);
+            } else {
+                trace("Freed " + std::to_string(result.freed) + " bytes of unused blobs", true);
+            }
+            trace("Removed " + std::to_string(stale) + " stale miss counters and lock files", true);
+
+            return ExitCode::ok;
+        }
+
         std::string commandString;
         std::string targetDirectoryPath;
+        std::string cacheKeyName;
+
+        const hash::Algorithm hashAlgorithm = hash::algorithmFromName(hashAlgorithmName);
+        const identity::Mode identityMode = identity::modeFromName(identityModeName);
+
+        // mapped on the first identity file hashed, a call without one never reads it
+        std::unique_ptr<FingerprintMemo> fingerprintMemo;
+        if (!noFingerprintMemo && !targetCacheDirectoryPath.empty()) {
+            std::string memoDirectory(targetCacheDirectoryPath);
+            std::error_code errorCode;
+
+            stdfs::create_directories(memoDirectory, errorCode);
+            fingerprintMemo.reset(new FingerprintMemo(generatePath(memoDirectory, fingerprintMemoFileName)));
+        }
 
         try {
-            generatedHashTargetDirectory = generateMd5FromString(getFileContents(identityFile));
+            std::vector<std::string> identityDigests;
+
+            if (!identityFiles.empty() || (identityDirectory.empty() && identityGitPath.empty())) {
+                const std::vector<std::string> expandedIdentityFiles = identity::expandPatterns(identityFiles);
+
+                if (seedNearest) {
+                    try {
+                        identityPackages = identity::packagesOf(expandedIdentityFiles);
+                    } catch (std::invalid_argument &exception) {
+                        trace(std::string(exception.what()));
+                    }
+                }
+                identityDigests.push_back(identity::fromFiles(
+                        expandedIdentityFiles,
+                        hashAlgorithm,
+                        identityMode,
+                        fingerprintMemo.get()
+                ));
+            }
+            if (!identityDirectory.empty()) {
+                identityDigests.push_back(identity::fromDirectory(
+                        identityDirectory,
+                        identityFilter,
+                        hashAlgorithm,
+                        fingerprintMemo.get()
+                ));
+            }
+            if (!identityGitPath.empty()) {
+                identityDigests.push_back(identity::fromGit(identityGitPath, identityFilter, hashAlgorithm));
+            }
+
+            generatedHashTargetDirectory =
+                    hash::keyPrefix(hashAlgorithm) + identity::combine(identityDigests, hashAlgorithm);
+
+            if (fingerprintMemo) {
+                fingerprintMemo->save();
+            }
         } catch (std::invalid_argument &exception) {
-            trace(exception.what());
-            trace(identityFile);
+            trace(std::string(exception.what()));
+            for (const auto &identityFile: identityFiles) {
+                trace(identityFile);
+            }
+            if (!identityDirectory.empty()) {
+                trace(identityDirectory);
+            }
+            if (!identityGitPath.empty()) {
+                trace(identityGitPath);
+            }
 
             return ExitCode::identityFileFailed;
         }
 
-        targetDirectoryPath = generatePath(targetCacheDirectoryPath, generatedHashTargetDirectory);
+        if (!keyCommand.empty()) {
+            commandString = generateCommand(commandWorkingDirectory, keyCommand);
+            trace("Execute: " + commandString);
+            generatedHashTargetDirectory = hash::keyPrefix(hashAlgorithm) + hash::fromString(
+                    generatedHashTargetDirectory + "\n" + cacheKey::commandOutput(commandString),
+                    hashAlgorithm
+            );
+        }
+
+        try {
+            cacheKeyName = cacheKey::render(keyTemplate, generatedHashTargetDirectory);
+        } catch (std::invalid_argument &exception) {
+            trace(exception.what(), true);
+
+            return ExitCode::argumentParsingFailed;
+        }
+
+        const std::string cacheDestination(targetCacheDirectoryPath);
+        targetDirectoryPath = store::entryPath(cacheDestination, cacheKeyName);
+        const std::string manifestFile = store::manifestPath(cacheDestination, cacheKeyName);
 
         trace("Identity file is: " + generatedHashTargetDirectory);
+        trace("Cache key is: " + cacheKeyName);
+
+        const std::string entryName = (archive) ? cacheKeyName + archiveExtension : cacheKeyName;
+        double inflation = 0;
+        auto isCached = [&] {
+            return store::lookup(cacheDestination, entryName, inflation);
+        };
+        bool foundCache = isCached();
+
+        // a restore holds the key lock shared, so the cache is not evicted meanwhile
+        KeyLock keyLock(store::lockPath(cacheDestination, entryName));
+        if (foundCache) {
+            try {
+                keyLock.share();
+            } catch (std::runtime_error &exception) {
+                trace(std::string(exception.what()));
+            }
+            foundCache = isCached();
+        }
 
-        const bool foundCache = (archive)
-                ? stdfs::exists(targetDirectoryPath + archiveExtension)
-                : stdfs::exists(targetDirectoryPath);
+        // a key is only cached once it was missed often enough, other misses run the setup unlocked
+        bool admitted = false;
+        if (!foundCache) {
+            entryStats::recordMiss(cacheDestination, entryName);
+            admitted = entryStats::misses(cacheDestination, entryName) >= admitAfter;
+        }
+
+        // of several processes missing the same key only the first one creates the cache
+        if (!foundCache && admitted) {
+            KeyLock::Outcome outcome = KeyLock::Outcome::timedOut;
+            try {
+                outcome = keyLock.acquire(std::chrono::seconds(lockTimeout), isCached, [](long long seconds) {
+                    trace("Waiting " + std::to_string(seconds) + "s for another cadir creating the cache");
+                });
+            } catch (std::runtime_error &exception) {
+                trace(std::string(exception.what()));
+            }
+            if (outcome == KeyLock::Outcome::timedOut) {
+                trace(std::string("Cache is created without the lock"));
+            }
+            foundCache = isCached();
+            if (foundCache) {
+                try {
+                    keyLock.share();
+                } catch (std::runtime_error &exception) {
+                    trace(std::string(exception.what()));
+                }
+            }
+        }
 
         if (!foundCache) {
             trace("No cache exists");
+
+            store::Entry seedEntry;
+            bool seeded = false;
+
+            if (!restoreKeys.empty()) {
+                if (store::findByPrefix(cacheDestination, restoreKeys, cacheKeyName, archive, seedEntry)) {
+                    seeded = seedFromEntry(
+                            cacheDestination,
+                            seedEntry,
+                            cacheSource,
+                            store::manifestPath(cacheDestination, seedEntry.key),
+                            archive,
+                            jobs
+                    );
+                } else {
+                    trace(std::string("No cache matches the restore keys"));
+                }
+            }
+            if (!seeded && seedNearest && !identityPackages.empty()) {
+                if (store::findNearest(cacheDestination, identityPackages, cacheKey::prefix(keyTemplate),
+                                       cacheKeyName, archive, seedEntry)) {
+                    seedFromEntry(
+                            cacheDestination,
+                            seedEntry,
+                            cacheSource,
+                            store::manifestPath(cacheDestination, seedEntry.key),
+                            archive,
+                            jobs
+                    );
+                } else {
+                    trace(std::string("No cache shares packages with the identity files"));
+                }
+            }
+
             commandString = generateCommand(commandWorkingDirectory, setupCommand);
 
+            std::string blobDirectory;
+            if (dedupe && !archive) {
+                std::string blobParentDirectory(cacheDestination);
+                blobDirectory = generatePath(blobParentDirectory, contentStore::blobDirectoryName);
+            }
+
             createCache(
                     setupCommand,
                     cacheSource,
                     commandString,
                     targetDirectoryPath,
-                    defaultCopyOptions,
-                    archive
+                    archive,
+                    blobDirectory,
+                    manifestFile,
+                    cacheDestination,
+                    admitted,
+                    jobs
             );
+
+            if (seedNearest && !identityPackages.empty()) {
+                store::writePackages(cacheDestination, cacheKeyName, identityPackages);
+            }
+
+            if (budget.isSet() && admitted) {
+                eviction::Result result = eviction::enforce(
+                        cacheDestination,
+                        budget,
+                        evictionPolicy,
+                        entryName,
+                        jobs
+                );
+                trace("Evicted " + std::to_string(result.evicted) + " caches of " +
+                      std::to_string(result.freed) + " bytes");
+            }
         } else {
             commandString =
                     (!finalizeCommand.empty())
@@ -174,15 +528,40 @@ int main(int argumentCount, char **argumentList) {
                     )
                     : "";
 
-            loadFromCache(
-                    cacheSource,
-                    currentWorkingDirectoryPath,
-                    linkCache,
-                    commandString,
-                    targetDirectoryPath,
-                    defaultCopyOptions,
-                    archive
-            );
+            // a cache published before the store was sharded is still in the flat layout
+            targetDirectoryPath = (stdfs::path(store::locate(cacheDestination, entryName)).parent_path() /
+                                   cacheKeyName).string();
+
+            try {
+                loadFromCache(
+                        cacheSource,
+                        currentWorkingDirectoryPath,
+                        linkCache,
+                        hardlinkCache,
+                        incrementalRestore,
+                        privateCopyPatterns,
+                        commandString,
+                        targetDirectoryPath,
+                        manifestFile,
+                        archive,
+                        jobs
+                );
+            } catch (CadirException &exception) {
+                // the index names a cache which was deleted by hand, the next run creates it again
+                if (!stdfs::exists(store::locate(cacheDestination, entryName))) {
+                    storeIndex::recordEviction(cacheDestination, entryName);
+                }
+                throw;
+            }
+
+            storeIndex::recordAccess(cacheDestination, entryName, inflation);
+        }
+
+        // a linked cache source leases its cache, still under the shared key lock
+        if (foundCache && linkCache && !archive && leaseDuration > 0) {
+            lease::take(cacheDestination, entryName, cacheSource, static_cast<int64_t>(leaseDuration));
+        } else {
+            lease::release(cacheDestination, cacheSource);
         }
 
         if (showCacheHit) {
@@ -191,7 +570,7 @@ int main(int argumentCount, char **argumentList) {
 
         return ExitCode::ok;
     } catch (CadirException &exception) {
-        trace(exception.what());
+        trace(std::string(exception.what()));
         return exception.getErrorCode();
     }
 }
@@ -212,22 +591,12 @@ void showHelpText(const std::string &helpText) {
     trace("15 = Removing existing cache folder failed", true);
     trace("16 = Cannot create cache directories", true);
     trace("17 = gzip error", true);
+    trace("18 = Key command failed", true);
     trace(true);
     trace("Version: " + CADIRFULLVERSION);
 }
 
 
-std::string getFileContents(const std::string &fileName) {
-    std::ifstream file(fileName);
-
-    if (!file.good()) {
-        throw std::invalid_argument("Cannot access file");
-    }
-
-    return std::string((std::istreambuf_iterator<char>(file)),
-                       std::istreambuf_iterator<char>());
-}
-
 std::string generatePath(std::string &directory, const std::string &name) {
     if (directory.back() != '/') {
         directory.append("/");
@@ -291,99 +660,262 @@ void trace(const std::string &log, bool const &force) {
 }
 
 
-std::string generateMd5FromString(const std::string &content) {
-    MD5_CTX context;
-    unsigned char md5Data[16];
-    char buffer[3];
-
-    MD5_Init(&context);
-    MD5_Update(&context, content.c_str(), strlen(content.c_str()));
-    MD5_Final(md5Data, &context);
-
-    std::string md5String;
-    for (unsigned char i : md5Data) {
-        sprintf(buffer, "%02x", i);
-        md5String.append(buffer);
-    }
-
-    return md5String;
-}
-
 void createCache(
         const std::string &setupCommand,
         const std::string &cacheSource,
         const std::string &commandString,
         const std::string &targetDirectoryPath,
-        const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const bool &archive,
+        const std::string &blobDirectory,
+        const std::string &manifestFile,
+        const std::string &cacheDestination,
+        const bool admit,
+        size_t jobs
 ) {
     trace("Execute: " + commandString);
+    const auto setupStart = std::chrono::steady_clock::now();
     int setupExitCode = executeCommand(commandString);
     if (setupExitCode != 0) {
         throw (SetupCommandException("Setup command failed", ExitCode::setupCommandFailed));
     }
+    const auto setupMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - setupStart
+    ).count();
+
+    if (!admit) {
+        trace(std::string("Key was not missed often enough, no cache is created"));
+
+        return;
+    }
+
+    std::vector<manifest::Record> records;
+    try {
+        trace("Read content of " + cacheSource);
+        records = manifest::build(cacheSource, jobs);
+    } catch (...) {
+        trace(std::string("Reading the cache source failed"));
+        throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
+    }
+
+    // the entry is built under a temporary name and only counts once it is published and marked
+    const std::string entryName = stdfs::path(targetDirectoryPath + (archive ? archiveExtension : "")).filename().string();
+    const std::string entryPath = targetDirectoryPath + (archive ? archiveExtension : "");
+    const std::string temporaryPath = store::temporaryPath(cacheDestination, entryName);
+    store::removeStaleTemporaries(cacheDestination);
+
     if (archive) {
         trace("Archive: " + targetDirectoryPath);
 
         stdfs::path cacheSourcePath(cacheSource);
-        std::string targetDirectoryPathString(targetDirectoryPath);
 
         std::vector<std::string> fileNames;
-        for (auto &p: stdfs::recursive_directory_iterator(cacheSource)) {
-            fileNames.push_back(p.path().u8string());
-            trace("add: " + p.path().u8string());
+        for (const auto &record: records) {
+            fileNames.push_back((cacheSourcePath / record.path).u8string());
+            trace("add: " + fileNames.back());
         }
 
         compress::write_archive(
                 cacheSourcePath.parent_path(),
-                targetDirectoryPathString.append(archiveExtension).c_str(),
+                temporaryPath.c_str(),
                 fileNames
         );
     } else {
         trace("Copy: " + targetDirectoryPath);
         try {
-            trace("Create cache directory: " + targetDirectoryPath);
-            stdfs::create_directories(targetDirectoryPath);
+            trace("Create cache directory: " + temporaryPath);
+            stdfs::create_directories(temporaryPath);
         } catch (...) {
             throw (CreateCacheDirectoryException("Create cache directories failed",
                                                  ExitCode::createCacheDirectoriesFailed));
         }
         try {
-            trace("Copy data from " + cacheSource + " to " + targetDirectoryPath);
-            stdfs::copy(cacheSource, targetDirectoryPath, copyOptions);
+            if (!blobDirectory.empty()) {
+                trace("Link data from " + cacheSource + " to " + temporaryPath + " using " + blobDirectory);
+                contentStore::store(cacheSource, temporaryPath, blobDirectory, records, jobs);
+            } else {
+                trace("Copy data from " + cacheSource + " to " + temporaryPath);
+                copyEngine::copyTree(cacheSource, temporaryPath, jobs, &records);
+            }
         } catch (...) {
             trace("Copy to cache failed");
+            std::error_code errorCode;
+            stdfs::remove_all(temporaryPath, errorCode);
             throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
         }
     }
+
+    bool published = false;
+    try {
+        // the files of the entry, hard links to blobs sync the blobs as well
+        if (archive) {
+            store::syncFile(temporaryPath);
+        } else {
+            store::syncTree(temporaryPath, records, jobs);
+        }
+        trace("Publish: " + entryPath);
+        published = store::publish(cacheDestination, entryName, temporaryPath, entryPath);
+    } catch (...) {
+        trace(std::string("Publishing the cache failed"));
+        std::error_code errorCode;
+        stdfs::remove_all(temporaryPath, errorCode);
+        throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
+    }
+    if (!published) {
+        trace(std::string("The cache was completed by another process meanwhile, it is kept"));
+
+        return;
+    }
+
+    // without a manifest the entry is walked when it is used
+    try {
+        trace("Write manifest: " + manifestFile);
+        stdfs::create_directories(stdfs::path(manifestFile).parent_path());
+        manifest::write(manifestFile, records);
+    } catch (...) {
+        trace("could not write manifest");
+    }
+
+    try {
+        store::syncParents(cacheDestination, entryPath);
+        store::markComplete(cacheDestination, entryName);
+    } catch (...) {
+        trace(std::string("Marking the cache complete failed"));
+        throw (CopyToCacheFailedException("Copy to cache failed", ExitCode::copyToCacheFailed));
+    }
+
+    // what a rebuild costs decides which caches are evicted first
+    entryStats::Stats stats;
+    stats.setupMilliseconds = static_cast<uint64_t>(setupMilliseconds);
+    for (const auto &record: records) {
+        if (record.isFile()) {
+            stats.size += record.size;
+        }
+    }
+    entryStats::write(cacheDestination, entryName, stats);
+
+    storeIndex::Record record;
+    record.name = entryName;
+    record.size = stats.size;
+    record.setupMilliseconds = stats.setupMilliseconds;
+    record.created = storeIndex::now();
+    record.base = storeIndex::Index::load(cacheDestination)->inflation();
+    storeIndex::recordPublish(cacheDestination, record);
+}
+
+/*
+ * Copies a cache entry directory, along its manifest if there is a valid
+ * one.
+ */
+void copyFromEntry(
+        const std::string &entryPath,
+        const std::string &cacheSource,
+        const std::string &manifestFile,
+        size_t jobs
+) {
+    std::unique_ptr<manifest::Manifest> entryManifest = manifest::Manifest::open(manifestFile);
+    if (!entryManifest) {
+        copyEngine::copyTree(entryPath, cacheSource, jobs);
+
+        return;
+    }
+
+    const std::vector<manifest::Record> records = entryManifest->records();
+    copyEngine::copyTree(entryPath, cacheSource, jobs, &records);
 }
 
-int updateAccessTime(const char *fileName) {
-    struct utimbuf utimbuf{};
+/*
+ * On a miss, materializes a similar entry into the cache source, so the
+ * setup command only has to update it.
+ */
+bool seedFromEntry(
+        const std::string &cacheDestination,
+        const store::Entry &entry,
+        const std::string &cacheSource,
+        const std::string &manifestFile,
+        const bool &archive,
+        size_t jobs
+) {
+    trace("Start from cache " + entry.key);
+
+    // held shared like a restore of a hit, so the seed is not evicted meanwhile
+    const std::string entryName = store::entryName(entry);
+    KeyLock keyLock(store::lockPath(cacheDestination, entryName));
+    try {
+        keyLock.share();
+    } catch (std::runtime_error &exception) {
+        trace(std::string(exception.what()));
+
+        return false;
+    }
+    if (!store::isComplete(cacheDestination, entryName)) {
+        trace(std::string("The cache was evicted meanwhile, setup starts from scratch"));
+
+        return false;
+    }
+    const std::string entryPath = store::locate(cacheDestination, entryName);
+
+    try {
+        if (stdfs::exists(cacheSource)) {
+            stdfs::remove_all(cacheSource);
+        }
+        if (archive) {
+            compress::extract(entryPath.c_str());
+        } else {
+            copyFromEntry(entryPath, cacheSource, manifestFile, jobs);
+        }
+        storeIndex::recordAccess(
+                cacheDestination,
+                entryName,
+                storeIndex::Index::load(cacheDestination)->inflation()
+        );
+    } catch (...) {
+        trace(std::string("Restore failed, setup starts from scratch"));
+        std::error_code errorCode;
+        stdfs::remove_all(cacheSource, errorCode);
 
-    utimbuf.modtime =  std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        return false;
+    }
 
-    return utime(fileName, &utimbuf);
+    return true;
 }
 
 void loadFromCache(
         const std::string &cacheSource,
         const std::string &currentWorkingDirectoryPath,
         const bool linkCache,
+        const bool hardlinkCache,
+        const bool incrementalRestore,
+        const std::vector<std::string> &privateCopyPatterns,
         const std::string &commandString,
         const std::string &targetDirectoryPath,
-        const stdfs::copy_options &copyOptions,
-        const bool &archive
+        const std::string &manifestFile,
+        const bool &archive,
+        size_t jobs
 ) {
     trace("Cache found");
+
+    std::unique_ptr<manifest::Manifest> entryManifest;
+    if (incrementalRestore && !linkCache && !hardlinkCache && !archive) {
+        entryManifest = manifest::Manifest::open(manifestFile);
+        if (!entryManifest) {
+            trace(std::string("No manifest for the cache, it is restored completely"));
+        }
+    }
+
+    // an archive is extracted in place, everything else but an update is staged and swapped in
+    const bool staged = !entryManifest && !archive;
+    std::string restorePath = cacheSource;
     try {
-        if (stdfs::exists(cacheSource)) {
+        if (staged) {
+            restorePath = staging::prepare(cacheSource);
+        } else if (!entryManifest && stdfs::exists(cacheSource)) {
             stdfs::remove_all(cacheSource);
         }
     } catch (...) {
         throw (CleaningFailedException("Cleaning for cache regeneration failed", ExitCode::cleaningFailed));
     }
     std::string fromPath = targetDirectoryPath;
+    std::unique_ptr<manifest::Manifest> linkManifest;
     if (!linkCache) {
         if (archive) {
             trace("Extract data from " + targetDirectoryPath + archiveExtension + " to " + cacheSource);
@@ -391,18 +923,39 @@ void loadFromCache(
             std::string fileNameWithExtension = targetDirectoryPathString.append(archiveExtension);
 
             compress::extract(fileNameWithExtension.c_str());
-
-            if (updateAccessTime(fileNameWithExtension.c_str()) != 0)
-                trace("could not update access time");
         } else {
             try {
-                trace("Copy data from " + targetDirectoryPath + " to " + cacheSource);
-                stdfs::copy(targetDirectoryPath, cacheSource, copyOptions);
-
-                if (updateAccessTime(cacheSource.c_str()) != 0)
-                    trace("could not update access time");
-
+                if (entryManifest) {
+                    trace("Update " + cacheSource + " from " + targetDirectoryPath);
+                    incremental::Result result = incremental::restore(
+                            targetDirectoryPath,
+                            cacheSource,
+                            entryManifest->records(),
+                            jobs
+                    );
+                    trace(std::to_string(result.copied) + " files copied, " +
+                          std::to_string(result.removed) + " paths replaced or removed, " +
+                          std::to_string(result.kept) + " kept");
+                } else if (hardlinkCache && (linkManifest = manifest::Manifest::open(manifestFile))) {
+                    trace("Link files from " + targetDirectoryPath + " to " + cacheSource);
+                    hardlink::materialize(targetDirectoryPath, restorePath, privateCopyPatterns,
+                                          linkManifest->records());
+                } else {
+                    // the manifest keeps the modes of protected files, without one the cache is copied
+                    trace("Copy data from " + targetDirectoryPath + " to " + cacheSource);
+                    copyFromEntry(targetDirectoryPath, restorePath, manifestFile, jobs);
+                }
+                if (staged) {
+                    staging::replace(restorePath, cacheSource);
+                }
             } catch (...) {
+                std::error_code errorCode;
+                if (staged) {
+                    stdfs::remove_all(restorePath, errorCode);
+                }
+                if (hardlinkCache) {
+                    throw (LinkFromCacheException("Cannot create hard links", ExitCode::createSymLinkFailed));
+                }
                 throw (CopyFromCacheException("Copy from cache failed", ExitCode::copyFromCacheFailed));
             }
 
@@ -422,11 +975,11 @@ void loadFromCache(
         }
         trace("Create link from " + fromPath + " to " + cacheSource);
         try {
-            stdfs::create_symlink(fromPath, cacheSource);
-
-            if (updateAccessTime(cacheSource.c_str()) != 0)
-                trace("could not update access time");
+            stdfs::create_symlink(fromPath, restorePath);
+            staging::replace(restorePath, cacheSource);
         } catch (...) {
+            std::error_code errorCode;
+            stdfs::remove(restorePath, errorCode);
             throw (LinkFromCacheException("Cannot create symlink", ExitCode::createSymLinkFailed));
         }
     }
@@ -0,0 +1,415 @@
+#pragma once //"manifest.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "hash.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Describes the content of a cache entry, so it does not have to be walked
+ * again. The manifest is a binary file of fixed size records sorted by path,
+ * followed by the path and symlink target strings. It is read through mmap.
+ * Regular files carry the blake3 digest of their content.
+ */
+namespace manifest {
+    const char magic[8] = {'C', 'A', 'D', 'I', 'R', 'M', 'F', 'T'};
+    const uint32_t formatVersion = 1;
+    // manifests written on a machine of the other byte order are ignored
+    const uint32_t byteOrderMark = 0x01020304;
+    const size_t digestLength = 32;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t recordCount;
+        uint64_t stringsOffset;
+    };
+
+    struct RawRecord {
+        uint64_t pathOffset;
+        uint32_t pathLength;
+        uint32_t mode;
+        uint64_t size;
+        int64_t modificationSeconds;
+        uint32_t modificationNanoseconds;
+        uint32_t linkLength;
+        uint64_t linkOffset;
+        unsigned char digest[digestLength];
+    };
+
+    struct Record {
+        std::string path;
+        uint32_t mode = 0;
+        uint64_t size = 0;
+        int64_t modificationSeconds = 0;
+        uint32_t modificationNanoseconds = 0;
+        std::string linkTarget;
+        // hex, empty for anything but regular files
+        std::string digest;
+
+        bool isDirectory() const {
+            return S_ISDIR(mode);
+        }
+
+        bool isSymlink() const {
+            return S_ISLNK(mode);
+        }
+
+        bool isFile() const {
+            return S_ISREG(mode);
+        }
+
+        /*
+         * Stat data for copying the file, device and access time are not
+         * recorded.
+         */
+        struct stat toStat(dev_t device) const {
+            struct stat st{};
+            st.st_dev = device;
+            st.st_mode = mode;
+            st.st_size = static_cast<off_t>(size);
+            st.st_mtim.tv_sec = modificationSeconds;
+            st.st_mtim.tv_nsec = modificationNanoseconds;
+            st.st_atim = st.st_mtim;
+
+            return st;
+        }
+    };
+
+    inline int hexValue(char digit) {
+        if (digit >= '0' && digit <= '9') return digit - '0';
+        if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+
+        return -1;
+    }
+
+    /*
+     * Reads the cache entry below the directory. Directories are read in
+     * parallel and files are hashed on the pool, unless only the stat data
+     * is wanted.
+     */
+    class Builder {
+        const std::string root;
+        const bool hashFiles;
+        ThreadPool pool;
+        std::mutex mutex;
+        std::vector<Record> records;
+
+        void addRecord(Record record) {
+            std::lock_guard<std::mutex> lock(mutex);
+            records.push_back(std::move(record));
+        }
+
+        void walk(const std::string &relativeDirectory) {
+            std::string directoryPath = relativeDirectory.empty() ? root : root + "/" + relativeDirectory;
+            DIR *directory = opendir(directoryPath.c_str());
+            if (directory == nullptr) {
+                throw std::runtime_error("Cannot access directory " + directoryPath);
+            }
+
+            while (struct dirent *entry = readdir(directory)) {
+                std::string name(entry->d_name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+
+                std::string relativePath = relativeDirectory.empty() ? name : relativeDirectory + "/" + name;
+                std::string path = root + "/" + relativePath;
+                struct stat st{};
+                if (lstat(path.c_str(), &st) != 0) {
+                    closedir(directory);
+                    throw std::runtime_error("Cannot access " + path);
+                }
+
+                Record record;
+                record.path = relativePath;
+                record.mode = st.st_mode;
+                record.modificationSeconds = st.st_mtim.tv_sec;
+                record.modificationNanoseconds = static_cast<uint32_t>(st.st_mtim.tv_nsec);
+
+                if (S_ISDIR(st.st_mode)) {
+                    addRecord(std::move(record));
+                    pool.submit([this, relativePath] { walk(relativePath); });
+                } else if (S_ISLNK(st.st_mode)) {
+                    record.linkTarget = stdfs::read_symlink(path).string();
+                    addRecord(std::move(record));
+                } else if (S_ISREG(st.st_mode)) {
+                    record.size = static_cast<uint64_t>(st.st_size);
+                    if (!hashFiles) {
+                        addRecord(std::move(record));
+                        continue;
+                    }
+                    pool.submit([this, path, record]() mutable {
+                        record.digest = hash::fromFile(path, hash::Algorithm::blake3);
+                        addRecord(std::move(record));
+                    });
+                }
+            }
+
+            closedir(directory);
+        }
+
+    public:
+        Builder(std::string root, bool hashFiles, size_t threadCount) :
+                root(std::move(root)),
+                hashFiles(hashFiles),
+                pool(threadCount) {}
+
+        std::vector<Record> run() {
+            pool.submit([this] { walk(""); });
+            pool.wait();
+
+            std::sort(records.begin(), records.end(), [](const Record &left, const Record &right) {
+                return left.path < right.path;
+            });
+
+            return std::move(records);
+        }
+    };
+
+    inline std::vector<Record> read(const std::string &directory, bool hashFiles, size_t threadCount) {
+        std::string root(directory);
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+
+        return Builder(root, hashFiles, threadCount == 0 ? ThreadPool::defaultThreadCount(16) : threadCount).run();
+    }
+
+    inline std::vector<Record> build(const std::string &directory, size_t threadCount) {
+        return read(directory, true, threadCount);
+    }
+
+    // the records without digests
+    inline std::vector<Record> scan(const std::string &directory, size_t threadCount) {
+        return read(directory, false, threadCount);
+    }
+
+    /*
+     * Writes the records, which must be sorted by path. The file is written
+     * under a temporary name and renamed.
+     */
+    inline void write(const std::string &manifestFile, const std::vector<Record> &records) {
+        std::vector<RawRecord> rawRecords(records.size());
+        std::string strings;
+
+        for (size_t i = 0; i < records.size(); i++) {
+            const Record &record = records[i];
+            RawRecord &raw = rawRecords[i];
+
+            memset(&raw, 0, sizeof(raw));
+            raw.pathOffset = strings.size();
+            raw.pathLength = static_cast<uint32_t>(record.path.size());
+            strings.append(record.path);
+            raw.linkOffset = strings.size();
+            raw.linkLength = static_cast<uint32_t>(record.linkTarget.size());
+            strings.append(record.linkTarget);
+            raw.mode = record.mode;
+            raw.size = record.size;
+            raw.modificationSeconds = record.modificationSeconds;
+            raw.modificationNanoseconds = record.modificationNanoseconds;
+            for (size_t j = 0; j < digestLength && 2 * j + 1 < record.digest.size(); j++) {
+                raw.digest[j] = static_cast<unsigned char>(
+                        hexValue(record.digest[2 * j]) << 4 | hexValue(record.digest[2 * j + 1]));
+            }
+        }
+
+        Header header{};
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.recordCount = records.size();
+        header.stringsOffset = sizeof(Header) + rawRecords.size() * sizeof(RawRecord);
+
+        std::string temporaryFile = manifestFile + ".tmp." + std::to_string(getpid());
+        int fd = open(temporaryFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot create manifest " + manifestFile);
+        }
+
+        auto writeAll = [fd](const void *data, size_t length) {
+            const char *position = static_cast<const char *>(data);
+            while (length > 0) {
+                ssize_t written = ::write(fd, position, length);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                position += written;
+                length -= static_cast<size_t>(written);
+            }
+
+            return true;
+        };
+
+        bool written = writeAll(&header, sizeof(header)) &&
+                       writeAll(rawRecords.data(), rawRecords.size() * sizeof(RawRecord)) &&
+                       writeAll(strings.data(), strings.size());
+        if (close(fd) != 0 || !written || rename(temporaryFile.c_str(), manifestFile.c_str()) != 0) {
+            unlink(temporaryFile.c_str());
+            throw std::runtime_error("Cannot write manifest " + manifestFile);
+        }
+    }
+
+    /*
+     * A manifest mapped into memory. open() returns nothing if the file is
+     * missing or not a valid manifest, callers walk the entry instead.
+     */
+    class Manifest {
+        void *mapping = MAP_FAILED;
+        size_t length = 0;
+        const RawRecord *rawRecords = nullptr;
+        const char *strings = nullptr;
+        size_t recordCount = 0;
+
+        Manifest() = default;
+
+        bool validate() {
+            if (length < sizeof(Header)) {
+                return false;
+            }
+            const auto *header = static_cast<const Header *>(mapping);
+            if (memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+                header->version != formatVersion ||
+                header->byteOrder != byteOrderMark ||
+                header->recordCount > (length - sizeof(Header)) / sizeof(RawRecord) ||
+                header->stringsOffset != sizeof(Header) + header->recordCount * sizeof(RawRecord)) {
+                return false;
+            }
+
+            recordCount = static_cast<size_t>(header->recordCount);
+            rawRecords = reinterpret_cast<const RawRecord *>(static_cast<const char *>(mapping) + sizeof(Header));
+            strings = static_cast<const char *>(mapping) + header->stringsOffset;
+            const uint64_t stringsLength = length - header->stringsOffset;
+            for (size_t i = 0; i < recordCount; i++) {
+                const RawRecord &raw = rawRecords[i];
+                if (raw.pathOffset > stringsLength || raw.pathLength > stringsLength - raw.pathOffset ||
+                    raw.linkOffset > stringsLength || raw.linkLength > stringsLength - raw.linkOffset) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+    public:
+        ~Manifest() {
+            if (mapping != MAP_FAILED) {
+                munmap(mapping, length);
+            }
+        }
+
+        Manifest(const Manifest &) = delete;
+
+        Manifest &operator=(const Manifest &) = delete;
+
+        static std::unique_ptr<Manifest> open(const std::string &manifestFile) {
+            int fd = ::open(manifestFile.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return nullptr;
+            }
+            struct stat st{};
+            if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+                close(fd);
+                return nullptr;
+            }
+
+            std::unique_ptr<Manifest> manifest(new Manifest());
+            manifest->length = static_cast<size_t>(st.st_size);
+            manifest->mapping = mmap(nullptr, manifest->length, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (manifest->mapping == MAP_FAILED || !manifest->validate()) {
+                return nullptr;
+            }
+
+            return manifest;
+        }
+
+        size_t size() const {
+            return recordCount;
+        }
+
+        std::string path(size_t index) const {
+            return std::string(strings + rawRecords[index].pathOffset, rawRecords[index].pathLength);
+        }
+
+        Record record(size_t index) const {
+            const RawRecord &raw = rawRecords[index];
+            Record record;
+
+            record.path.assign(strings + raw.pathOffset, raw.pathLength);
+            record.linkTarget.assign(strings + raw.linkOffset, raw.linkLength);
+            record.mode = raw.mode;
+            record.size = raw.size;
+            record.modificationSeconds = raw.modificationSeconds;
+            record.modificationNanoseconds = raw.modificationNanoseconds;
+            if (S_ISREG(raw.mode)) {
+                record.digest = hash::toHex(raw.digest, digestLength);
+            }
+
+            return record;
+        }
+
+        std::vector<Record> records() const {
+            std::vector<Record> result;
+            result.reserve(recordCount);
+            for (size_t i = 0; i < recordCount; i++) {
+                result.push_back(record(i));
+            }
+
+            return result;
+        }
+
+        /*
+         * Binary search by relative path. Returns false if there is no record.
+         */
+        bool find(const std::string &relativePath, Record &found) const {
+            size_t low = 0;
+            size_t high = recordCount;
+
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                const RawRecord &raw = rawRecords[middle];
+                int comparison = relativePath.compare(0, std::string::npos, strings + raw.pathOffset, raw.pathLength);
+                if (comparison == 0) {
+                    found = record(middle);
+                    return true;
+                }
+                if (comparison < 0) {
+                    high = middle;
+                } else {
+                    low = middle + 1;
+                }
+            }
+
+            return false;
+        }
+
+        // the bytes of all regular files
+        uint64_t contentSize() const {
+            uint64_t total = 0;
+            for (size_t i = 0; i < recordCount; i++) {
+                if (S_ISREG(rawRecords[i].mode)) {
+                    total += rawRecords[i].size;
+                }
+            }
+
+            return total;
+        }
+    };
+}
@@ -0,0 +1,58 @@
+#pragma once //"processOwner.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Names of temporary files and trees end with the tag "<pid>@<host>" of the
+ * process which writes them, so a process may remove what a gone process
+ * left behind. Only the pids of this host can be checked, the cache
+ * destination may be shared by several hosts. Files of other hosts, or
+ * named without a host by earlier versions, are only removed once they are
+ * older than a day.
+ */
+namespace processOwner {
+    const int64_t staleAge = 24 * 60 * 60;
+
+    inline std::string hostName() {
+        char name[256] = {};
+        if (gethostname(name, sizeof(name) - 1) != 0) {
+            return "";
+        }
+
+        return name;
+    }
+
+    inline std::string tag() {
+        return std::to_string(getpid()) + "@" + hostName();
+    }
+
+    inline bool isOlderThan(const std::string &path, int64_t seconds) {
+        struct stat st{};
+
+        return lstat(path.c_str(), &st) == 0 &&
+               static_cast<int64_t>(st.st_mtime) + seconds < static_cast<int64_t>(std::time(nullptr));
+    }
+
+    /*
+     * Whether the process of the tag at the start of ownerTag is gone, the
+     * path is the file or tree it names.
+     */
+    inline bool isGone(const std::string &ownerTag, const std::string &path) {
+        const pid_t owner = static_cast<pid_t>(std::atoll(ownerTag.c_str()));
+        const std::string::size_type separator = ownerTag.find('@');
+        const bool thisHost = separator != std::string::npos &&
+                              ownerTag.compare(separator + 1, std::string::npos, hostName()) == 0;
+        if (owner <= 0 || !thisHost) {
+            return isOlderThan(path, staleAge);
+        }
+
+        return owner != getpid() && kill(owner, 0) != 0 && errno == ESRCH;
+    }
+}
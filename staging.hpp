@@ -0,0 +1,276 @@
+#pragma once //"staging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <config.h>
+#include "copyEngine.hpp"
+#include "processOwner.hpp"
+#include "threadPool.hpp"
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+extern char **environ;
+
+/*
+ * Restores into a sibling of the cache source and swaps it into place, so a
+ * restore does not wait for the old tree to be deleted. The swap exchanges
+ * both trees with renameat2 where the file system supports it, otherwise the
+ * old tree is renamed away first. The old tree is deleted by a detached
+ * cadir process, trees left over by earlier runs are deleted along with it.
+ */
+namespace staging {
+    const std::string stageMarker = ".cadir-stage-";
+    const std::string trashMarker = ".cadir-trash-";
+    const std::string removeOption = "--remove-tree";
+
+    inline stdfs::path normalized(const std::string &cacheSource) {
+        stdfs::path path = stdfs::absolute(cacheSource).lexically_normal();
+
+        return path.filename().empty() ? path.parent_path() : path;
+    }
+
+    inline std::string siblingPath(const std::string &cacheSource, const std::string &marker) {
+        stdfs::path path = normalized(cacheSource);
+
+        return (path.parent_path() / ("." + path.filename().string() + marker + processOwner::tag())).string();
+    }
+
+    inline bool isStaged(const std::string &path) {
+        const std::string name = stdfs::path(path).filename().string();
+
+        return name.find(stageMarker) != std::string::npos || name.find(trashMarker) != std::string::npos;
+    }
+
+    /*
+     * An empty staging directory path next to the cache source, its parent
+     * directories are created.
+     */
+    inline std::string prepare(const std::string &cacheSource) {
+        std::string stage = siblingPath(cacheSource, stageMarker);
+
+        stdfs::create_directories(stdfs::path(stage).parent_path());
+        stdfs::remove_all(stage);
+
+        return stage;
+    }
+
+    inline bool exchange(const std::string &from, const std::string &to) {
+#ifdef SYS_renameat2
+        return syscall(SYS_renameat2, AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_EXCHANGE) == 0;
+#else
+        errno = ENOSYS;
+
+        return false;
+#endif
+    }
+
+    /*
+     * Trees of earlier runs whose process is gone, e.g. because the
+     * background deletion was killed with the job. Trees of other hosts
+     * sharing the directory are only taken once they are old.
+     */
+    inline std::vector<std::string> leftovers(const std::string &cacheSource) {
+        std::vector<std::string> trees;
+        stdfs::path path = normalized(cacheSource);
+        const std::string prefix = "." + path.filename().string();
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(path.parent_path(), errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            const std::string name = iterator->path().filename().string();
+            for (const auto &marker: {stageMarker, trashMarker}) {
+                if (name.compare(0, prefix.size() + marker.size(), prefix + marker) != 0) {
+                    continue;
+                }
+                if (processOwner::isGone(name.substr(prefix.size() + marker.size()), iterator->path().string())) {
+                    trees.push_back(iterator->path().string());
+                }
+            }
+        }
+
+        return trees;
+    }
+
+    /*
+     * Deletes the trees in a detached cadir process. Returns false if the
+     * process could not be started.
+     */
+    inline bool removeInBackground(const std::vector<std::string> &trees) {
+        std::vector<std::string> arguments{"cadir"};
+        for (const auto &tree: trees) {
+            arguments.push_back(removeOption);
+            arguments.push_back(tree);
+        }
+        std::vector<char *> argumentList;
+        for (auto &argument: arguments) {
+            argumentList.push_back(&argument[0]);
+        }
+        argumentList.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attributes;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attributes);
+        for (int descriptor: {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO}) {
+            posix_spawn_file_actions_addopen(&actions, descriptor, "/dev/null", O_RDWR, 0);
+        }
+#ifdef POSIX_SPAWN_SETSID
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSID);
+#endif
+
+        pid_t child = 0;
+        int result = posix_spawn(&child, "/proc/self/exe", &actions, &attributes, argumentList.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attributes);
+
+        return result == 0;
+    }
+
+    /*
+     * Swaps the staging directory into the place of the cache source. The
+     * old cache source is deleted in the background.
+     */
+    inline void replace(const std::string &stage, const std::string &cacheSource) {
+        const std::string trash = siblingPath(cacheSource, trashMarker);
+        struct stat st{};
+        bool hadSource = lstat(cacheSource.c_str(), &st) == 0;
+
+        if (!hadSource) {
+            if (rename(stage.c_str(), cacheSource.c_str()) != 0) {
+                throw std::runtime_error("Cannot move " + stage + " to " + cacheSource);
+            }
+        } else if (exchange(stage, cacheSource)) {
+            if (rename(stage.c_str(), trash.c_str()) != 0) {
+                throw std::runtime_error("Cannot move " + stage + " to " + trash);
+            }
+        } else {
+            if (rename(cacheSource.c_str(), trash.c_str()) != 0) {
+                throw std::runtime_error("Cannot move " + cacheSource + " to " + trash);
+            }
+            if (rename(stage.c_str(), cacheSource.c_str()) != 0) {
+                rename(trash.c_str(), cacheSource.c_str());
+                throw std::runtime_error("Cannot move " + stage + " to " + cacheSource);
+            }
+        }
+
+        // a link of the link mode needs no other process
+        std::vector<std::string> trees = leftovers(cacheSource);
+        if (hadSource && !S_ISDIR(st.st_mode)) {
+            unlink(trash.c_str());
+        } else if (hadSource) {
+            trees.push_back(trash);
+        }
+        if (!trees.empty() && !removeInBackground(trees)) {
+            std::error_code errorCode;
+            for (const auto &tree: trees) {
+                stdfs::remove_all(tree, errorCode);
+            }
+        }
+    }
+
+    /*
+     * Deletes a tree with unlinkat on directory descriptors, every directory
+     * is read by its own task. The emptied directories are removed deepest
+     * first at the end.
+     */
+    class TreeRemover {
+        ThreadPool pool;
+        std::mutex mutex;
+        std::vector<std::string> directories;
+
+        void clear(const std::string &path) {
+            int descriptor = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (descriptor < 0) {
+                return;
+            }
+            auto closeDirectory = [](DIR *openDirectory) { closedir(openDirectory); };
+            std::unique_ptr<DIR, decltype(closeDirectory)> directory(fdopendir(descriptor), closeDirectory);
+            if (!directory) {
+                close(descriptor);
+                return;
+            }
+
+            struct stat st{};
+            if (fstat(descriptor, &st) == 0 && (st.st_mode & S_IRWXU) != S_IRWXU) {
+                fchmod(descriptor, (st.st_mode & 07777) | S_IRWXU);
+            }
+
+            while (struct dirent *entry = readdir(directory.get())) {
+                std::string name(entry->d_name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+
+                bool isDirectory = entry->d_type == DT_DIR;
+                if (entry->d_type == DT_UNKNOWN) {
+                    isDirectory = fstatat(descriptor, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                  S_ISDIR(st.st_mode);
+                }
+                if (!isDirectory) {
+                    unlinkat(descriptor, entry->d_name, 0);
+                    continue;
+                }
+
+                std::string subdirectory = path + "/" + name;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    directories.push_back(subdirectory);
+                }
+                pool.submit([this, subdirectory] { clear(subdirectory); });
+            }
+        }
+
+    public:
+        explicit TreeRemover(size_t threadCount) : pool(threadCount) {
+        }
+
+        void remove(const std::string &path) {
+            directories.clear();
+            clear(path);
+            pool.wait();
+
+            std::sort(directories.begin(), directories.end(), [](const std::string &left, const std::string &right) {
+                return std::count(left.begin(), left.end(), '/') > std::count(right.begin(), right.end(), '/');
+            });
+            for (const auto &directory: directories) {
+                rmdir(directory.c_str());
+            }
+            if (rmdir(path.c_str()) != 0) {
+                unlink(path.c_str());
+            }
+        }
+    };
+
+    /*
+     * The work of the background process, only trees named by the staging
+     * are deleted.
+     */
+    inline void removeTrees(const std::vector<std::string> &trees, size_t threadCount) {
+        setpriority(PRIO_PROCESS, 0, 10);
+
+        TreeRemover remover(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (const auto &tree: trees) {
+            if (isStaged(tree)) {
+                remover.remove(tree);
+            }
+        }
+    }
+}
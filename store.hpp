@@ -0,0 +1,668 @@
+#pragma once //"store.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "copyEngine.hpp"
+#include "entryStats.hpp"
+#include "keyLock.hpp"
+#include "lease.hpp"
+#include "lockfile.hpp"
+#include "processOwner.hpp"
+#include "storeIndex.hpp"
+#include "storeLayout.hpp"
+#include "threadPool.hpp"
+
+/*
+ * Knows how cache entries are laid out in the cache destination. An entry
+ * is a directory or an archive named by its key, it counts once its
+ * completion marker exists. Names starting with a dot belong to cadir itself.
+ * Entries and their metadata files are placed by the store layout, flat or
+ * in shard directories.
+ */
+namespace store {
+    const std::string archiveExtension = ".tar.gz";
+    const std::string packageIndexDirectory = ".cadir-packages";
+    const std::string manifestDirectory = ".cadir-manifests";
+    const std::string manifestExtension = ".manifest";
+    const std::string completionDirectory = ".cadir-complete";
+    const std::string temporaryPrefix = ".cadir-tmp-";
+    const std::string lockDirectory = ".cadir-locks";
+    const std::string lockExtension = ".lock";
+
+    struct Entry {
+        std::string key;
+        std::string path;
+        bool archive = false;
+        // seconds since the epoch
+        int64_t lastUsed = 0;
+    };
+
+    inline bool endsWith(const std::string &value, const std::string &suffix) {
+        return value.size() >= suffix.size() &&
+               value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    inline std::string entryName(const Entry &entry) {
+        return entry.archive ? entry.key + archiveExtension : entry.key;
+    }
+
+    /*
+     * Where a new entry is published in the layout of the cache destination.
+     */
+    inline std::string entryPath(const std::string &destination, const std::string &entryName) {
+        return storeLayout::newPath(destination, destination, entryName);
+    }
+
+    /*
+     * Where an existing entry is, an entry published in the flat layout by a
+     * process started before the store was sharded is found there.
+     */
+    inline std::string locate(const std::string &destination, const std::string &entryName) {
+        return storeLayout::path(destination, destination, entryName);
+    }
+
+    inline std::string lockPath(const std::string &destination, const std::string &entryName) {
+        return storeLayout::path(destination, (stdfs::path(destination) / lockDirectory).string(),
+                                 entryName + lockExtension);
+    }
+
+    // named like the entry, so a directory and an archive of the same key are told apart
+    inline std::string completionPath(const std::string &destination, const std::string &entryName) {
+        return storeLayout::path(destination, (stdfs::path(destination) / completionDirectory).string(), entryName);
+    }
+
+    inline bool isComplete(const std::string &destination, const std::string &entryName) {
+        return access(completionPath(destination, entryName).c_str(), F_OK) == 0;
+    }
+
+    /*
+     * Whether an entry is complete, answered by the store index without
+     * touching the entry. Complete entries the index does not know, of
+     * older versions, are added to it. The inflation of the index is
+     * returned for the access to record.
+     */
+    inline bool lookup(const std::string &destination, const std::string &entryName, double &inflation) {
+        std::unique_ptr<storeIndex::Index> index = storeIndex::Index::load(destination);
+        inflation = index->inflation();
+
+        storeIndex::Record record;
+        if (index->find(entryName, record)) {
+            return record.state == storeIndex::State::complete;
+        }
+        if (!isComplete(destination, entryName) || !stdfs::exists(locate(destination, entryName))) {
+            return false;
+        }
+
+        entryStats::Stats stats;
+        if (entryStats::read(destination, entryName, stats)) {
+            record.size = stats.size;
+            record.setupMilliseconds = stats.setupMilliseconds;
+        }
+        record.name = entryName;
+        record.created = storeIndex::now();
+        record.base = inflation;
+        storeIndex::recordPublish(destination, record);
+
+        return true;
+    }
+
+    /*
+     * Where an entry is built before it is published, on the file system of
+     * the cache destination. The name ends with the tag of the process.
+     */
+    inline std::string temporaryPath(const std::string &destination, const std::string &entryName) {
+        return (stdfs::path(destination) / (temporaryPrefix + entryName + "-" + processOwner::tag())).string();
+    }
+
+    inline void syncFile(const std::string &path) {
+        int descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (descriptor < 0 || fsync(descriptor) != 0) {
+            if (descriptor >= 0) {
+                close(descriptor);
+            }
+            throw std::runtime_error("Cannot sync " + path);
+        }
+        close(descriptor);
+    }
+
+    /*
+     * Writes back the files of a built entry, in batches on the pool, then
+     * its directories, deepest first, and the entry directory itself. Only
+     * the entry is synced, not the whole file system of the cache
+     * destination other processes write to as well.
+     */
+    inline void syncTree(const std::string &root, const std::vector<manifest::Record> &records, size_t threadCount) {
+        const size_t batchSize = 64;
+        std::vector<std::string> files;
+        std::vector<std::string> directories;
+        for (const auto &record: records) {
+            if (record.isFile()) {
+                files.push_back((stdfs::path(root) / record.path).string());
+            } else if (record.isDirectory()) {
+                directories.push_back((stdfs::path(root) / record.path).string());
+            }
+        }
+        std::sort(directories.begin(), directories.end(), [](const std::string &left, const std::string &right) {
+            return left.size() > right.size();
+        });
+
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (size_t start = 0; start < files.size(); start += batchSize) {
+            pool.submit([&files, start, batchSize] {
+                for (size_t index = start; index < std::min(start + batchSize, files.size()); index++) {
+                    syncFile(files[index]);
+                }
+            });
+        }
+        pool.wait();
+        for (const auto &directory: directories) {
+            syncFile(directory);
+        }
+        syncFile(root);
+    }
+
+    /*
+     * Writes back the directories from the one of a published entry up to
+     * the cache destination, so the rename and any new shard directories
+     * are durable.
+     */
+    inline void syncParents(const std::string &destination, const std::string &entry) {
+        const stdfs::path top = stdfs::path(destination).lexically_normal();
+        stdfs::path directory = stdfs::path(entry).lexically_normal().parent_path();
+        for (;;) {
+            syncFile(directory.string());
+            if (directory == top || directory.parent_path() == directory ||
+                directory.string().size() <= top.string().size()) {
+                break;
+            }
+            directory = directory.parent_path();
+        }
+    }
+
+    /*
+     * Moves a built entry to its name with one rename. An entry already
+     * there without a completion marker was left by a crashed run and is
+     * replaced. A complete one was published by a process which created
+     * the entry at the same time, e.g. after a lock timeout, and may be in
+     * use: it is kept, the built entry is deleted and false returned.
+     * Missing shard directories are created.
+     */
+    inline bool publish(
+            const std::string &destination,
+            const std::string &entryName,
+            const std::string &temporary,
+            const std::string &entry
+    ) {
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(entry).parent_path(), errorCode);
+        if (rename(temporary.c_str(), entry.c_str()) == 0) {
+            return true;
+        }
+        if (errno != EEXIST && errno != ENOTEMPTY && errno != EISDIR) {
+            throw std::runtime_error("Cannot publish " + entry);
+        }
+
+        if (isComplete(destination, entryName)) {
+            stdfs::remove_all(temporary, errorCode);
+            return false;
+        }
+        stdfs::remove_all(entry, errorCode);
+        if (rename(temporary.c_str(), entry.c_str()) != 0) {
+            throw std::runtime_error("Cannot publish " + entry);
+        }
+
+        return true;
+    }
+
+    /*
+     * Written after the entry and its manifest are published and synced, an
+     * entry without it is not used.
+     */
+    inline void markComplete(const std::string &destination, const std::string &entryName) {
+        const std::string marker = completionPath(destination, entryName);
+        const stdfs::path directory = stdfs::path(marker).parent_path();
+        stdfs::create_directories(directory);
+
+        {
+            std::ofstream file(marker, std::ios::trunc);
+            if (!file.good()) {
+                throw std::runtime_error("Cannot write " + marker);
+            }
+        }
+        syncFile(marker);
+        syncFile(directory.string());
+    }
+
+    /*
+     * Removes entries which were built or evicted by processes that are gone.
+     */
+    inline void removeStaleTemporaries(const std::string &destination) {
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(destination, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            std::string name = iterator->path().filename().string();
+            if (name.compare(0, temporaryPrefix.size(), temporaryPrefix) != 0) {
+                continue;
+            }
+            // entry names have no '@', host names may have a '-'
+            const std::string::size_type separator = name.rfind('-', name.rfind('@'));
+            if (processOwner::isGone(name.substr(separator + 1), iterator->path().string())) {
+                std::error_code removeErrorCode;
+                stdfs::remove_all(iterator->path(), removeErrorCode);
+            }
+        }
+    }
+
+    /*
+     * Entries of the given kind among the children of one directory, the
+     * shard directories of the cache destination are skipped.
+     */
+    inline void listDirectory(
+            const std::string &destination,
+            const std::string &directory,
+            bool archive,
+            const storeIndex::Index &index,
+            std::vector<Entry> &entries
+    ) {
+        std::error_code errorCode;
+        const bool isDestination = directory == destination;
+
+        for (stdfs::directory_iterator iterator(directory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            std::string name = iterator->path().filename().string();
+            if (name.empty() || name.front() == '.' || (isDestination && storeLayout::isShardName(name))) {
+                continue;
+            }
+
+            Entry entry;
+            entry.path = iterator->path().string();
+            entry.archive = archive;
+            if (archive) {
+                if (!endsWith(name, archiveExtension) || !iterator->is_regular_file(errorCode)) {
+                    continue;
+                }
+                entry.key = name.substr(0, name.size() - archiveExtension.size());
+            } else {
+                if (!iterator->is_directory(errorCode)) {
+                    continue;
+                }
+                entry.key = name;
+            }
+
+            storeIndex::Record record;
+            struct stat st{};
+            if (index.find(name, record)) {
+                if (record.state != storeIndex::State::complete) {
+                    continue;
+                }
+                entry.lastUsed = std::max(record.lastAccess, record.created);
+            } else if (lstat(entry.path.c_str(), &st) == 0 && isComplete(destination, name)) {
+                entry.lastUsed = static_cast<int64_t>(st.st_mtime);
+            } else {
+                continue;
+            }
+            entries.push_back(entry);
+            errorCode.clear();
+        }
+    }
+
+    inline std::vector<std::string> shardDirectories(const std::string &directory) {
+        std::vector<std::string> shards;
+        std::error_code errorCode;
+
+        for (stdfs::directory_iterator iterator(directory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            if (storeLayout::isShardName(iterator->path().filename().string()) && iterator->is_directory(errorCode)) {
+                shards.push_back(iterator->path().string());
+            }
+            errorCode.clear();
+        }
+
+        return shards;
+    }
+
+    /*
+     * Complete entries of the given kind, of the flat layout and of all
+     * shards, the shards are read in parallel. They were last used when the
+     * store index saw their last access, or when they were modified for
+     * entries the index does not know.
+     */
+    inline std::vector<Entry> list(const std::string &destination, bool archive, size_t threadCount = 0) {
+        std::vector<Entry> entries;
+        std::unique_ptr<storeIndex::Index> index = storeIndex::Index::load(destination);
+
+        listDirectory(destination, destination, archive, *index, entries);
+        if (!storeLayout::isSharded(destination)) {
+            return entries;
+        }
+
+        std::mutex mutex;
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (const auto &shard: shardDirectories(destination)) {
+            pool.submit([&, shard] {
+                for (const auto &subshard: shardDirectories(shard)) {
+                    std::vector<Entry> shardEntries;
+                    listDirectory(destination, subshard, archive, *index, shardEntries);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    entries.insert(entries.end(), shardEntries.begin(), shardEntries.end());
+                }
+            });
+        }
+        pool.wait();
+
+        return entries;
+    }
+
+    /*
+     * Takes the exclusive key lock of the entry at both places its lock file
+     * may be in, so no process holds the entry by a lock file of the other
+     * layout. Returns false if another process holds one of them.
+     */
+    inline bool lockExclusively(
+            const std::string &destination,
+            const std::string &entryName,
+            std::vector<std::unique_ptr<KeyLock>> &keyLocks
+    ) {
+        for (const auto &file: storeLayout::paths(destination, (stdfs::path(destination) / lockDirectory).string(),
+                                                  entryName + lockExtension)) {
+            keyLocks.push_back(std::unique_ptr<KeyLock>(new KeyLock(file)));
+            if (!keyLocks.back()->tryExclusive()) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /*
+     * Moves the files of the metadata directory still in the flat layout into
+     * their shards. Files of the sharded layout written meanwhile are kept.
+     */
+    inline size_t shardDirectory(const stdfs::path &directory) {
+        std::vector<std::string> names;
+        std::error_code errorCode;
+        for (stdfs::directory_iterator iterator(directory, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            std::string name = iterator->path().filename().string();
+            if (name.empty() || name.front() == '.' || storeLayout::isShardName(name) ||
+                name.find(".tmp.") != std::string::npos || !iterator->is_regular_file(errorCode)) {
+                errorCode.clear();
+                continue;
+            }
+            names.push_back(name);
+        }
+        if (names.empty()) {
+            return 0;
+        }
+
+        size_t moved = 0;
+        for (const auto &name: names) {
+            const std::string from = storeLayout::flatPath(directory.string(), name);
+            const std::string to = storeLayout::shardedPath(directory.string(), name);
+            std::error_code moveErrorCode;
+            stdfs::create_directories(stdfs::path(to).parent_path(), moveErrorCode);
+            struct stat st{};
+            if (lstat(to.c_str(), &st) == 0) {
+                stdfs::remove(from, moveErrorCode);
+            } else if (rename(from.c_str(), to.c_str()) == 0) {
+                moved++;
+            }
+        }
+        syncFile(directory.string());
+
+        return moved;
+    }
+
+    /*
+     * Switches the cache destination to the sharded layout and moves the
+     * entries of the flat layout into their shards, each under its
+     * exclusive key lock, then the files of the metadata directories. The
+     * marker is written first, so entries and files created meanwhile go to
+     * their shard. Entries in use or leased by a linked cache source are left
+     * in place and moved by the next call. Lock files are not moved, the flat
+     * lock file of a moved entry is removed, those of keys without an entry
+     * are removed by gc. Returns the number of moved entries.
+     */
+    inline size_t shard(const std::string &destination, size_t threadCount) {
+        const std::string marker = (stdfs::path(destination) / storeLayout::layoutFile).string();
+        if (!storeLayout::isSharded(destination)) {
+            stdfs::create_directories(destination);
+            entryStats::writeText(marker, storeLayout::shardedLayout + "\n");
+            if (!storeLayout::isSharded(destination)) {
+                throw std::runtime_error("Cannot write " + marker);
+            }
+        }
+
+        std::vector<std::string> names;
+        std::error_code errorCode;
+        for (stdfs::directory_iterator iterator(destination, errorCode), end;
+             !errorCode && iterator != end;
+             iterator.increment(errorCode)) {
+            std::string name = iterator->path().filename().string();
+            if (name.empty() || name.front() == '.' || storeLayout::isShardName(name)) {
+                continue;
+            }
+            if (iterator->is_directory(errorCode) ||
+                (endsWith(name, archiveExtension) && iterator->is_regular_file(errorCode))) {
+                names.push_back(name);
+            }
+            errorCode.clear();
+        }
+
+        std::atomic<size_t> moved{0};
+        lease::Leases leases = lease::readAll(destination);
+        std::mutex leasesMutex;
+        ThreadPool pool(threadCount == 0 ? copyEngine::defaultJobs() : threadCount);
+        for (const auto &name: names) {
+            pool.submit([&destination, &moved, &leases, &leasesMutex, name] {
+                std::vector<std::unique_ptr<KeyLock>> keyLocks;
+                if (!lockExclusively(destination, name, keyLocks)) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(leasesMutex);
+                    if (lease::isLeased(destination, name, leases)) {
+                        return;
+                    }
+                }
+                const std::string from = storeLayout::flatPath(destination, name);
+                const std::string to = storeLayout::shardedPath(destination, name);
+                std::error_code moveErrorCode;
+                stdfs::create_directories(stdfs::path(to).parent_path(), moveErrorCode);
+                if (rename(from.c_str(), to.c_str()) != 0) {
+                    return;
+                }
+                moved++;
+                // unlinked while held, a process waiting for it opens it anew, evictions lock both
+                unlink(storeLayout::flatPath((stdfs::path(destination) / lockDirectory).string(),
+                                             name + lockExtension).c_str());
+            });
+        }
+        pool.wait();
+        syncFile(destination);
+
+        for (const auto &directory: {completionDirectory, manifestDirectory, packageIndexDirectory,
+                                     entryStats::statsDirectory}) {
+            shardDirectory(stdfs::path(destination) / directory);
+        }
+
+        return moved;
+    }
+
+    /*
+     * The most recently used entry whose key starts with one of the prefixes,
+     * the prefixes are tried in order. Returns false if none matches.
+     */
+    inline bool findByPrefix(
+            const std::string &destination,
+            const std::vector<std::string> &prefixes,
+            const std::string &exceptKey,
+            bool archive,
+            Entry &found
+    ) {
+        std::vector<Entry> entries = list(destination, archive);
+
+        for (const auto &prefix: prefixes) {
+            bool matched = false;
+            for (const auto &entry: entries) {
+                if (entry.key == exceptKey || entry.key.compare(0, prefix.size(), prefix) != 0) {
+                    continue;
+                }
+                if (!matched || entry.lastUsed > found.lastUsed) {
+                    found = entry;
+                    matched = true;
+                }
+            }
+            if (matched) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    inline std::string manifestPath(const std::string &destination, const std::string &key) {
+        return storeLayout::path(destination, (stdfs::path(destination) / manifestDirectory).string(),
+                                 key + manifestExtension);
+    }
+
+    inline std::string packageIndexPath(const std::string &destination, const std::string &key) {
+        return storeLayout::path(destination, (stdfs::path(destination) / packageIndexDirectory).string(), key);
+    }
+
+    /*
+     * Stores the resolved packages an entry was built from, one
+     * "name<TAB>version<TAB>integrity<TAB>section" line each.
+     */
+    inline void writePackages(
+            const std::string &destination,
+            const std::string &key,
+            const std::vector<lockfile::Package> &packages
+    ) {
+        std::string indexFile = packageIndexPath(destination, key);
+        std::error_code errorCode;
+        stdfs::create_directories(stdfs::path(indexFile).parent_path(), errorCode);
+
+        std::string temporaryFile = indexFile + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream file(temporaryFile, std::ios::trunc);
+            for (const auto &package: packages) {
+                file << package.name << '\t' << package.version << '\t' << package.integrity << '\t'
+                     << package.section << '\n';
+            }
+            if (!file.good()) {
+                file.close();
+                stdfs::remove(temporaryFile, errorCode);
+                return;
+            }
+        }
+        stdfs::rename(temporaryFile, indexFile, errorCode);
+        if (errorCode) {
+            stdfs::remove(temporaryFile, errorCode);
+        }
+    }
+
+    inline std::vector<lockfile::Package> readPackages(const std::string &destination, const std::string &key) {
+        std::ifstream file(packageIndexPath(destination, key));
+        std::vector<lockfile::Package> packages;
+        std::string line;
+
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            lockfile::Package package;
+            if (std::getline(fields, package.name, '\t') &&
+                std::getline(fields, package.version, '\t') &&
+                std::getline(fields, package.integrity, '\t')) {
+                // indexes of older versions have no section
+                std::getline(fields, package.section);
+                packages.push_back(package);
+            }
+        }
+
+        return packages;
+    }
+
+    inline size_t commonPackages(const std::vector<lockfile::Package> &left, const std::vector<lockfile::Package> &right) {
+        size_t common = 0;
+        auto leftPackage = left.begin();
+        auto rightPackage = right.begin();
+
+        while (leftPackage != left.end() && rightPackage != right.end()) {
+            if (*leftPackage < *rightPackage) {
+                leftPackage++;
+            } else if (*rightPackage < *leftPackage) {
+                rightPackage++;
+            } else {
+                common++;
+                leftPackage++;
+                rightPackage++;
+            }
+        }
+
+        return common;
+    }
+
+    /*
+     * The entry sharing the most resolved packages with the given sorted
+     * package set, among the entries whose key starts with the key prefix,
+     * so an entry of another platform or runtime is never the seed. Ties go
+     * to the entry with fewer other packages, then to the most recently
+     * used one. Returns false if no entry shares any.
+     */
+    inline bool findNearest(
+            const std::string &destination,
+            const std::vector<lockfile::Package> &packages,
+            const std::string &keyPrefix,
+            const std::string &exceptKey,
+            bool archive,
+            Entry &found
+    ) {
+        size_t bestCommon = 0;
+        size_t bestSize = 0;
+
+        for (const auto &entry: list(destination, archive)) {
+            if (entry.key == exceptKey || entry.key.compare(0, keyPrefix.size(), keyPrefix) != 0) {
+                continue;
+            }
+            std::vector<lockfile::Package> entryPackages = readPackages(destination, entry.key);
+            std::sort(entryPackages.begin(), entryPackages.end());
+            size_t common = commonPackages(packages, entryPackages);
+            if (common == 0) {
+                continue;
+            }
+
+            bool better = common > bestCommon ||
+                          (common == bestCommon && entryPackages.size() < bestSize) ||
+                          (common == bestCommon && entryPackages.size() == bestSize && entry.lastUsed > found.lastUsed);
+            if (better) {
+                found = entry;
+                bestCommon = common;
+                bestSize = entryPackages.size();
+            }
+        }
+
+        return bestCommon > 0;
+    }
+}
@@ -0,0 +1,520 @@
+#pragma once //"storeIndex.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+
+/*
+ * Answers lookups of the cache destination from one file instead of the
+ * entries themselves. The index is a binary file of fixed size records
+ * sorted by entry name, read through mmap, with key, size, setup time,
+ * creation and last access time, hits and state of every entry. Changes
+ * are appended as lines to a journal, a hit costs one append instead of a
+ * metadata write on the entry. Once the journal is large it is compacted
+ * into a new index.
+ *
+ * Appends hold the lock file shared, compaction holds it exclusively. Both
+ * files carry a generation, a reader which sees an index and a journal of
+ * different generations raced a compaction and reads them again.
+ */
+namespace storeIndex {
+    const char magic[8] = {'C', 'A', 'D', 'I', 'R', 'I', 'D', 'X'};
+    const uint32_t formatVersion = 1;
+    const uint32_t byteOrderMark = 0x01020304;
+    const std::string indexFileName = ".cadir-index";
+    const std::string journalExtension = ".journal";
+    const std::string lockExtension = ".lock";
+    const off_t compactionSize = 256 * 1024;
+    const int readAttempts = 3;
+
+    enum class State : uint32_t {
+        complete = 1,
+        evicted = 2,
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t generation;
+        uint64_t recordCount;
+        uint64_t stringsOffset;
+        double inflation;
+    };
+
+    struct RawRecord {
+        uint64_t nameOffset;
+        uint32_t nameLength;
+        uint32_t state;
+        uint64_t size;
+        uint64_t setupMilliseconds;
+        int64_t created;
+        int64_t lastAccess;
+        uint64_t hits;
+        // the eviction inflation at the last access
+        double base;
+    };
+
+    struct Record {
+        std::string name;
+        State state = State::complete;
+        uint64_t size = 0;
+        uint64_t setupMilliseconds = 0;
+        int64_t created = 0;
+        int64_t lastAccess = 0;
+        uint64_t hits = 0;
+        double base = 0;
+    };
+
+    inline std::string indexPath(const std::string &destination) {
+        return (stdfs::path(destination) / indexFileName).string();
+    }
+
+    inline std::string journalPath(const std::string &destination) {
+        return indexPath(destination) + journalExtension;
+    }
+
+    inline std::string lockPath(const std::string &destination) {
+        return indexPath(destination) + lockExtension;
+    }
+
+    inline int64_t now() {
+        return static_cast<int64_t>(time(nullptr));
+    }
+
+    inline std::string formatNumber(double number) {
+        std::ostringstream text;
+        text << std::setprecision(17) << number;
+
+        return text.str();
+    }
+
+    inline bool compact(const std::string &destination);
+
+    class Index {
+        void *mapping = MAP_FAILED;
+        size_t length = 0;
+        const RawRecord *rawRecords = nullptr;
+        const char *strings = nullptr;
+        size_t recordCount = 0;
+        uint64_t indexGeneration = 0;
+        uint64_t journalGeneration = 0;
+        double inflationValue = 0;
+        std::map<std::string, Record> journalRecords;
+
+        Index() = default;
+
+        bool validate() {
+            if (length < sizeof(Header)) {
+                return false;
+            }
+            const auto *header = static_cast<const Header *>(mapping);
+            if (memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+                header->version != formatVersion ||
+                header->byteOrder != byteOrderMark ||
+                header->recordCount > (length - sizeof(Header)) / sizeof(RawRecord) ||
+                header->stringsOffset != sizeof(Header) + header->recordCount * sizeof(RawRecord)) {
+                return false;
+            }
+
+            recordCount = static_cast<size_t>(header->recordCount);
+            rawRecords = reinterpret_cast<const RawRecord *>(static_cast<const char *>(mapping) + sizeof(Header));
+            strings = static_cast<const char *>(mapping) + header->stringsOffset;
+            const uint64_t stringsLength = length - header->stringsOffset;
+            for (size_t i = 0; i < recordCount; i++) {
+                const RawRecord &raw = rawRecords[i];
+                if (raw.nameOffset > stringsLength || raw.nameLength > stringsLength - raw.nameOffset) {
+                    return false;
+                }
+            }
+            indexGeneration = header->generation;
+            inflationValue = header->inflation;
+
+            return true;
+        }
+
+        void map(const std::string &indexFile) {
+            int fd = ::open(indexFile.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st{};
+            if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Header))) {
+                length = static_cast<size_t>(st.st_size);
+                mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if (mapping != MAP_FAILED && !validate()) {
+                unmap();
+            }
+        }
+
+        void unmap() {
+            if (mapping != MAP_FAILED) {
+                munmap(mapping, length);
+            }
+            mapping = MAP_FAILED;
+            length = 0;
+            rawRecords = nullptr;
+            strings = nullptr;
+            recordCount = 0;
+            indexGeneration = 0;
+            inflationValue = 0;
+        }
+
+        Record mappedRecord(size_t index) const {
+            const RawRecord &raw = rawRecords[index];
+            Record record;
+            record.name = std::string(strings + raw.nameOffset, raw.nameLength);
+            record.state = static_cast<State>(raw.state);
+            record.size = raw.size;
+            record.setupMilliseconds = raw.setupMilliseconds;
+            record.created = raw.created;
+            record.lastAccess = raw.lastAccess;
+            record.hits = raw.hits;
+            record.base = raw.base;
+
+            return record;
+        }
+
+        bool findMapped(const std::string &name, Record &record) const {
+            size_t low = 0;
+            size_t high = recordCount;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                const RawRecord &raw = rawRecords[middle];
+                int comparison = name.compare(0, std::string::npos, strings + raw.nameOffset, raw.nameLength);
+                if (comparison == 0) {
+                    record = mappedRecord(middle);
+                    return true;
+                }
+                if (comparison < 0) {
+                    high = middle;
+                } else {
+                    low = middle + 1;
+                }
+            }
+
+            return false;
+        }
+
+        // a line without its newline is still being written and ignored
+        void readJournal(const std::string &journalFile) {
+            journalRecords.clear();
+            journalGeneration = 0;
+
+            std::ifstream stream(journalFile, std::ios::binary);
+            std::string content((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+            std::istringstream lines(content.substr(0, content.rfind('\n') == std::string::npos
+                                                      ? 0 : content.rfind('\n') + 1));
+            std::string line;
+            while (std::getline(lines, line)) {
+                std::istringstream fields(line);
+                std::string operation;
+                std::string name;
+                std::getline(fields, operation, '\t');
+                if (operation == "generation") {
+                    fields >> journalGeneration;
+                    continue;
+                }
+                if (operation == "inflation") {
+                    fields >> inflationValue;
+                    continue;
+                }
+                if (!std::getline(fields, name, '\t') || name.empty()) {
+                    continue;
+                }
+
+                Record record;
+                bool known = find(name, record);
+                if (operation == "publish") {
+                    Record published;
+                    published.name = name;
+                    if (!(fields >> published.size >> published.setupMilliseconds >> published.created
+                                 >> published.base)) {
+                        continue;
+                    }
+                    // a complete entry published again keeps its use
+                    if (known && record.state == State::complete) {
+                        published.hits = record.hits;
+                        published.lastAccess = record.lastAccess;
+                    }
+                    journalRecords[name] = published;
+                } else if (operation == "access" && known) {
+                    int64_t accessed = 0;
+                    double base = 0;
+                    if (fields >> accessed >> base) {
+                        record.lastAccess = std::max(record.lastAccess, accessed);
+                        record.hits++;
+                        record.base = std::max(record.base, base);
+                        journalRecords[name] = record;
+                    }
+                } else if (operation == "evict" && known) {
+                    record.state = State::evicted;
+                    journalRecords[name] = record;
+                }
+            }
+        }
+
+    public:
+        ~Index() {
+            unmap();
+        }
+
+        Index(const Index &) = delete;
+
+        Index &operator=(const Index &) = delete;
+
+        /*
+         * The index with its journal applied, for a caller holding the lock
+         * file, so no compaction runs meanwhile. Generations which disagree
+         * are taken as they are, the journal is applied to whatever index
+         * there is.
+         */
+        static std::unique_ptr<Index> loadLocked(const std::string &destination) {
+            std::unique_ptr<Index> index(new Index());
+            index->map(indexPath(destination));
+            index->readJournal(journalPath(destination));
+
+            return index;
+        }
+
+        /*
+         * The index with its journal applied. A missing or damaged index is
+         * an empty one, so the journal alone is used.
+         */
+        static std::unique_ptr<Index> load(const std::string &destination) {
+            std::unique_ptr<Index> index(new Index());
+
+            for (int attempt = 0; attempt <= readAttempts; attempt++) {
+                index->unmap();
+                index->map(indexPath(destination));
+                index->readJournal(journalPath(destination));
+                if (index->indexGeneration == index->journalGeneration) {
+                    return index;
+                }
+                // the generations stay apart after a compaction was killed
+                // halfway or the index was damaged, a compaction joins them
+                if (attempt == readAttempts - 1) {
+                    compact(destination);
+                }
+            }
+
+            // another process holds the lock exclusively and keeps compacting
+            int lockDescriptor = ::open(lockPath(destination).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (lockDescriptor >= 0 && flock(lockDescriptor, LOCK_SH) == 0) {
+                index = loadLocked(destination);
+            }
+            if (lockDescriptor >= 0) {
+                close(lockDescriptor);
+            }
+
+            return index;
+        }
+
+        bool find(const std::string &name, Record &record) const {
+            auto journalRecord = journalRecords.find(name);
+            if (journalRecord != journalRecords.end()) {
+                record = journalRecord->second;
+                return true;
+            }
+
+            return findMapped(name, record);
+        }
+
+        std::vector<Record> records() const {
+            std::vector<Record> merged;
+            for (size_t i = 0; i < recordCount; i++) {
+                Record record = mappedRecord(i);
+                if (journalRecords.find(record.name) == journalRecords.end()) {
+                    merged.push_back(record);
+                }
+            }
+            for (const auto &journalRecord: journalRecords) {
+                merged.push_back(journalRecord.second);
+            }
+            std::sort(merged.begin(), merged.end(), [](const Record &left, const Record &right) {
+                return left.name < right.name;
+            });
+
+            return merged;
+        }
+
+        uint64_t generation() const {
+            return std::max(indexGeneration, journalGeneration);
+        }
+
+        double inflation() const {
+            return inflationValue;
+        }
+    };
+
+    inline void write(
+            const std::string &indexFile,
+            const std::vector<Record> &records,
+            uint64_t generation,
+            double inflation
+    ) {
+        std::vector<RawRecord> rawRecords(records.size());
+        std::string strings;
+
+        for (size_t i = 0; i < records.size(); i++) {
+            const Record &record = records[i];
+            RawRecord &raw = rawRecords[i];
+
+            memset(&raw, 0, sizeof(raw));
+            raw.nameOffset = strings.size();
+            raw.nameLength = static_cast<uint32_t>(record.name.size());
+            strings.append(record.name);
+            raw.state = static_cast<uint32_t>(record.state);
+            raw.size = record.size;
+            raw.setupMilliseconds = record.setupMilliseconds;
+            raw.created = record.created;
+            raw.lastAccess = record.lastAccess;
+            raw.hits = record.hits;
+            raw.base = record.base;
+        }
+
+        Header header{};
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.generation = generation;
+        header.recordCount = records.size();
+        header.stringsOffset = sizeof(Header) + rawRecords.size() * sizeof(RawRecord);
+        header.inflation = inflation;
+
+        std::string temporaryFile = indexFile + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream file(temporaryFile, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char *>(rawRecords.data()),
+                       static_cast<std::streamsize>(rawRecords.size() * sizeof(RawRecord)));
+            file.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+            if (!file.good()) {
+                file.close();
+                unlink(temporaryFile.c_str());
+                throw std::runtime_error("Cannot write index " + indexFile);
+            }
+        }
+        if (rename(temporaryFile.c_str(), indexFile.c_str()) != 0) {
+            unlink(temporaryFile.c_str());
+            throw std::runtime_error("Cannot write index " + indexFile);
+        }
+    }
+
+    /*
+     * Folds the journal into a new index, if no other process appends or
+     * compacts right now. Evicted entries are dropped. The new journal only
+     * names the new generation and replaces the old one with a rename. The
+     * new generation is above both old ones, so index and journal which
+     * disagree are joined again.
+     */
+    inline bool compact(const std::string &destination) {
+        int lockDescriptor = ::open(lockPath(destination).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (lockDescriptor < 0) {
+            return false;
+        }
+        if (flock(lockDescriptor, LOCK_EX | LOCK_NB) != 0) {
+            close(lockDescriptor);
+            return false;
+        }
+
+        bool compacted = false;
+        try {
+            std::unique_ptr<Index> index = Index::loadLocked(destination);
+            std::vector<Record> records = index->records();
+            records.erase(std::remove_if(records.begin(), records.end(), [](const Record &record) {
+                return record.state == State::evicted;
+            }), records.end());
+
+            const uint64_t generation = index->generation() + 1;
+            write(indexPath(destination), records, generation, index->inflation());
+
+            const std::string journalFile = journalPath(destination);
+            const std::string temporaryFile = journalFile + ".tmp." + std::to_string(getpid());
+            bool written = false;
+            {
+                std::ofstream file(temporaryFile, std::ios::trunc);
+                file << "generation\t" << generation << '\n';
+                file.flush();
+                written = file.good();
+            }
+            compacted = written && rename(temporaryFile.c_str(), journalFile.c_str()) == 0;
+            if (!compacted) {
+                unlink(temporaryFile.c_str());
+            }
+        } catch (std::exception &) {
+            compacted = false;
+        }
+        close(lockDescriptor);
+
+        return compacted;
+    }
+
+    /*
+     * Appends one line with a single write under the shared lock, and
+     * compacts the journal once it grew large.
+     */
+    inline void append(const std::string &destination, const std::string &line) {
+        std::error_code errorCode;
+        stdfs::create_directories(destination, errorCode);
+
+        int lockDescriptor = ::open(lockPath(destination).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (lockDescriptor < 0) {
+            return;
+        }
+        off_t journalSize = 0;
+        if (flock(lockDescriptor, LOCK_SH) == 0) {
+            int fd = ::open(journalPath(destination).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+            if (fd >= 0) {
+                const std::string text = line + '\n';
+                struct stat st{};
+                if (::write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()) && fstat(fd, &st) == 0) {
+                    journalSize = st.st_size;
+                }
+                close(fd);
+            }
+        }
+        close(lockDescriptor);
+
+        if (journalSize > compactionSize) {
+            compact(destination);
+        }
+    }
+
+    inline void recordPublish(const std::string &destination, const Record &record) {
+        append(destination, "publish\t" + record.name + '\t' + std::to_string(record.size) + '\t' +
+                            std::to_string(record.setupMilliseconds) + '\t' + std::to_string(record.created) + '\t' +
+                            formatNumber(record.base));
+    }
+
+    inline void recordAccess(const std::string &destination, const std::string &name, double base) {
+        append(destination, "access\t" + name + '\t' + std::to_string(now()) + '\t' + formatNumber(base));
+    }
+
+    inline void recordEviction(const std::string &destination, const std::string &name) {
+        append(destination, "evict\t" + name);
+    }
+
+    inline void recordInflation(const std::string &destination, double inflation) {
+        append(destination, "inflation\t" + formatNumber(inflation));
+    }
+}
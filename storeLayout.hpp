@@ -0,0 +1,103 @@
+#pragma once //"storeLayout.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <config.h>
+#include "hash.hpp"
+
+/*
+ * Where entries and the files cadir keeps per key are in the cache
+ * destination. In the flat layout they are children of the cache
+ * destination and of its metadata directories. Once the layout marker
+ * exists they are put into two levels of shard directories named by the
+ * md5 of the key, "ab/cd/<name>", in the cache destination and in every
+ * metadata directory alike. Files still in the flat layout, of processes
+ * started before the store was sharded or not moved yet, are found there.
+ */
+namespace storeLayout {
+    const std::string layoutFile = ".cadir-layout";
+    const std::string shardedLayout = "sharded";
+    // what follows the key in the names of entries and metadata files
+    const std::vector<std::string> nameSuffixes = {".lock", ".misses", ".manifest", ".tar.gz"};
+
+    inline bool isSharded(const std::string &destination) {
+        return access((stdfs::path(destination) / layoutFile).c_str(), F_OK) == 0;
+    }
+
+    // two lowercase hex digits, the name of a shard directory
+    inline bool isShardName(const std::string &name) {
+        return name.size() == 2 && std::all_of(name.begin(), name.end(), [](char character) {
+            return (character >= '0' && character <= '9') || (character >= 'a' && character <= 'f');
+        });
+    }
+
+    /*
+     * The key a file name belongs to, so the entry, its archive and all
+     * their metadata files share one shard.
+     */
+    inline std::string keyOf(std::string name) {
+        for (const auto &suffix: nameSuffixes) {
+            if (name.size() > suffix.size() &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                name.erase(name.size() - suffix.size());
+            }
+        }
+
+        return name;
+    }
+
+    inline stdfs::path shardOf(const std::string &name) {
+        const std::string digest = hash::fromString(keyOf(name), hash::Algorithm::md5);
+
+        return stdfs::path(digest.substr(0, 2)) / digest.substr(2, 2);
+    }
+
+    inline std::string flatPath(const std::string &directory, const std::string &name) {
+        return (stdfs::path(directory) / name).string();
+    }
+
+    inline std::string shardedPath(const std::string &directory, const std::string &name) {
+        return (stdfs::path(directory) / shardOf(name) / name).string();
+    }
+
+    /*
+     * The path of a new file of the directory, which is the cache destination
+     * or one of its metadata directories.
+     */
+    inline std::string newPath(const std::string &destination, const std::string &directory, const std::string &name) {
+        return isSharded(destination) ? shardedPath(directory, name) : flatPath(directory, name);
+    }
+
+    /*
+     * The path of a file of the directory, the flat one if only that exists.
+     */
+    inline std::string path(const std::string &destination, const std::string &directory, const std::string &name) {
+        if (!isSharded(destination)) {
+            return flatPath(directory, name);
+        }
+
+        const std::string sharded = shardedPath(directory, name);
+        const std::string flat = flatPath(directory, name);
+        struct stat st{};
+        if (lstat(sharded.c_str(), &st) != 0 && lstat(flat.c_str(), &st) == 0) {
+            return flat;
+        }
+
+        return sharded;
+    }
+
+    /*
+     * Both places a file may be in, the one it is looked up at first.
+     */
+    inline std::vector<std::string> paths(const std::string &destination, const std::string &directory,
+                                          const std::string &name) {
+        const std::string found = path(destination, directory, name);
+        const std::string other = found == flatPath(directory, name) ? shardedPath(directory, name)
+                                                                     : flatPath(directory, name);
+
+        return isSharded(destination) ? std::vector<std::string>{found, other} : std::vector<std::string>{found};
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once //"threadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed size work stealing pool. Every worker owns a queue, tasks submitted
+ * by a worker go to its own queue and idle workers steal from the others.
+ * Tasks may submit further tasks, wait() returns after all of them are done
+ * and rethrows the first exception a task threw.
+ */
+class ThreadPool {
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable allDone;
+    std::mutex exceptionMutex;
+    std::exception_ptr firstException;
+    std::atomic<size_t> pendingTasks{0};
+    std::atomic<size_t> queuedTasks{0};
+    std::atomic<size_t> nextQueue{0};
+    bool stopping = false;
+
+    static thread_local ThreadPool *currentPool;
+    static thread_local size_t currentQueue;
+
+    // the owner takes the oldest task, so submission order is kept as far as possible
+    bool popOwn(size_t index, std::function<void()> &task) {
+        WorkQueue &queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+
+        return true;
+    }
+
+    bool steal(size_t index, std::function<void()> &task) {
+        for (size_t offset = 1; offset < queues.size(); offset++) {
+            WorkQueue &queue = *queues[(index + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(std::function<void()> &task) {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(exceptionMutex);
+            if (!firstException) {
+                firstException = std::current_exception();
+            }
+        }
+
+        if (--pendingTasks == 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            allDone.notify_all();
+        }
+    }
+
+    void work(size_t index) {
+        currentPool = this;
+        currentQueue = index;
+
+        for (;;) {
+            std::function<void()> task;
+            if (popOwn(index, task) || steal(index, task)) {
+                queuedTasks--;
+                run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            taskAvailable.wait(lock, [this] { return stopping || queuedTasks > 0; });
+            if (stopping && queuedTasks == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threadCount) {
+        if (threadCount == 0) {
+            threadCount = 1;
+        }
+        for (size_t i = 0; i < threadCount; i++) {
+            queues.emplace_back(new WorkQueue());
+        }
+        for (size_t i = 0; i < threadCount; i++) {
+            workers.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (auto &worker: workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static size_t defaultThreadCount(size_t maximum) {
+        size_t hardwareThreads = std::thread::hardware_concurrency();
+
+        return std::max<size_t>(1, std::min(hardwareThreads == 0 ? 1 : hardwareThreads, maximum));
+    }
+
+    void submit(std::function<void()> task) {
+        size_t index = (currentPool == this)
+                       ? currentQueue
+                       : nextQueue++ % queues.size();
+
+        pendingTasks++;
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        queuedTasks++;
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        taskAvailable.notify_one();
+    }
+
+    void wait() {
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            allDone.wait(lock, [this] { return pendingTasks == 0; });
+        }
+
+        std::lock_guard<std::mutex> lock(exceptionMutex);
+        if (firstException) {
+            std::exception_ptr exception = firstException;
+            firstException = nullptr;
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+inline thread_local ThreadPool *ThreadPool::currentPool = nullptr;
+inline thread_local size_t ThreadPool::currentQueue = 0;